@@ -0,0 +1,290 @@
+#include "batchScheduler.h"
+#include "variationalLm.h"
+
+#include "dynet/expr.h"
+#include "dynet/tensor.h"
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+
+BatchScheduler::BatchScheduler(VariationalLm* pt_model,
+                               unsigned int max_batch_size,
+                               unsigned int max_latency_ms,
+                               unsigned int bucket_width)
+    : d_pt_model(pt_model)
+      , d_max_batch_size(max_batch_size)
+      , d_max_latency(max_latency_ms)
+      , d_bucket_width(bucket_width)
+      , d_num_pending(0)
+      , d_stopped(false)
+{
+    if(d_max_batch_size == 0){
+        std::cout << "max_batch_size cannot be zero" << std::endl;
+        abort();
+    }
+
+    if(d_bucket_width == 0){
+        std::cout << "bucket_width cannot be zero" << std::endl;
+        abort();
+    }
+
+    d_worker = std::thread(&BatchScheduler::run, this);
+}
+
+BatchScheduler::~BatchScheduler()
+{
+    this->stop();
+}
+
+std::future<SCORE_RESULT_t> BatchScheduler::submit(const std::vector<int>& sent)
+{
+    PENDING_REQUEST_t request;
+    request.sent = sent;
+    request.arrival = std::chrono::steady_clock::now();
+    std::future<SCORE_RESULT_t> result = request.promise.get_future();
+
+    if(sent.size() < 2){
+        // Need at least <bos> and <eos> to score the sent
+        request.promise.set_exception(std::make_exception_ptr(
+            std::invalid_argument("BatchScheduler: sentence must have at least two words")));
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        if(d_stopped){
+            request.promise.set_exception(std::make_exception_ptr(
+                std::runtime_error("BatchScheduler: submit called after stop")));
+            return result;
+        }
+        unsigned int bucket_id = (sent.size() - 1) / d_bucket_width;
+        d_buckets[bucket_id].push_back(std::move(request));
+        ++d_num_pending;
+    }
+    d_cv.notify_one();
+
+    return result;
+}
+
+void BatchScheduler::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_stopped = true;
+    }
+    d_cv.notify_one();
+
+    if(d_worker.joinable()){
+        d_worker.join();
+    }
+}
+
+void BatchScheduler::run()
+{
+    typedef std::map<unsigned int, std::deque<PENDING_REQUEST_t> >::iterator BucketIterator;
+
+    std::vector<PENDING_REQUEST_t> batch;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(d_mutex);
+            while(true){
+                if(d_stopped && d_num_pending == 0){
+                    return;
+                }
+
+                /*
+                * Choose the bucket to flush:
+                * 1) the bucket with the oldest request if its deadline has passed
+                *    (or if we are draining after stop)
+                * 2) otherwise any bucket that is full
+                * If neither exists, sleep until the earliest deadline.
+                */
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                BucketIterator oldest_it = d_buckets.end();
+                BucketIterator full_it = d_buckets.end();
+                for(BucketIterator it=d_buckets.begin(); it!=d_buckets.end(); ++it){
+                    if(it->second.empty()){
+                        continue;
+                    }
+                    if(oldest_it == d_buckets.end() ||
+                           it->second.front().arrival < oldest_it->second.front().arrival){
+                        oldest_it = it;
+                    }
+                    if(full_it == d_buckets.end() && it->second.size() >= d_max_batch_size){
+                        full_it = it;
+                    }
+                }
+
+                if(oldest_it == d_buckets.end()){
+                    d_cv.wait(lock);
+                    continue;
+                }
+
+                std::chrono::steady_clock::time_point deadline =
+                                   oldest_it->second.front().arrival + d_max_latency;
+                BucketIterator flush_it = d_buckets.end();
+                if(deadline <= now || d_stopped){
+                    flush_it = oldest_it;
+                }else if(full_it != d_buckets.end()){
+                    flush_it = full_it;
+                }
+
+                if(flush_it == d_buckets.end()){
+                    d_cv.wait_until(lock, deadline);
+                    continue;
+                }
+
+                std::deque<PENDING_REQUEST_t>& bucket = flush_it->second;
+                while(!bucket.empty() && batch.size() < d_max_batch_size){
+                    batch.push_back(std::move(bucket.front()));
+                    bucket.pop_front();
+                }
+                d_num_pending -= batch.size();
+                break;
+            }
+        }
+
+        this->run_batch(&batch);
+        batch.clear();
+    }
+}
+
+void BatchScheduler::run_batch(std::vector<PENDING_REQUEST_t>* pt_batch)
+{
+    /*
+    * Requests of the same length are run as one minibatch through
+    * VariationalLm::encode_batch/decode_batch (explicit batching, this does
+    * not rely on --dynet-autobatch). With bucket_width > 1 a flush can hold
+    * several lengths: each gets its own minibatch in the same graph and a
+    * single forward is run over all of them. z = mu is used for decoding so
+    * that scores are deterministic.
+    */
+
+    std::vector<PENDING_REQUEST_t>& batch = *pt_batch;
+    try{
+        std::shared_ptr<dynet::ComputationGraph> sp_cg =
+                             std::make_shared<dynet::ComputationGraph>();
+
+        // sent length --> indices in batch
+        std::map<size_t, std::vector<size_t> > indices_for_length;
+        for(size_t i=0; i<batch.size(); ++i){
+            indices_for_length[batch[i].sent.size()].push_back(i);
+        }
+
+        // per request: {mu, logvar, enc_error, dec_error}
+        std::vector<dynet::Expression> mus(batch.size());
+        std::vector<dynet::Expression> logvars(batch.size());
+        std::vector<dynet::Expression> enc_errors(batch.size());
+        std::vector<dynet::Expression> dec_errors(batch.size());
+        std::vector<dynet::Expression> tot_errors;
+        for(std::map<size_t, std::vector<size_t> >::const_iterator it=indices_for_length.begin();
+               it!=indices_for_length.end(); ++it){
+            const std::vector<size_t>& indices = it->second;
+            std::vector<const std::vector<int>*> sents;
+            for(size_t j=0; j<indices.size(); ++j){
+                sents.push_back(&batch[indices[j]].sent);
+            }
+
+            std::shared_ptr<dynet::Expression> sp_mu = std::make_shared<dynet::Expression>();
+            std::shared_ptr<dynet::Expression> sp_logvar = std::make_shared<dynet::Expression>();
+            std::shared_ptr<dynet::Expression> sp_enc_error = std::make_shared<dynet::Expression>();
+            std::shared_ptr<dynet::Expression> sp_dec_error = std::make_shared<dynet::Expression>();
+            d_pt_model->encode_batch(sp_cg, sp_mu, sp_logvar, sp_enc_error, sents);
+            d_pt_model->decode_batch(sp_cg, sp_mu, sp_dec_error, sents);
+            tot_errors.push_back(dynet::sum_batches((*sp_enc_error) + (*sp_dec_error)));
+
+            for(size_t j=0; j<indices.size(); ++j){
+                mus[indices[j]] = dynet::pick_batch_elem(*sp_mu, j);
+                logvars[indices[j]] = dynet::pick_batch_elem(*sp_logvar, j);
+                enc_errors[indices[j]] = dynet::pick_batch_elem(*sp_enc_error, j);
+                dec_errors[indices[j]] = dynet::pick_batch_elem(*sp_dec_error, j);
+            }
+        }
+
+        dynet::Expression tot_error = dynet::sum(tot_errors);
+        sp_cg->forward(tot_error);
+
+        // Scatter the results back to the clients
+        for(size_t i=0; i<batch.size(); ++i){
+            SCORE_RESULT_t result;
+            result.mu = dynet::as_vector(mus[i].value());
+            result.logvar = dynet::as_vector(logvars[i].value());
+            result.enc_error = dynet::as_scalar(enc_errors[i].value());
+            result.dec_error = dynet::as_scalar(dec_errors[i].value());
+            batch[i].promise.set_value(result);
+        }
+    }catch(...){
+        std::exception_ptr error = std::current_exception();
+        for(size_t i=0; i<batch.size(); ++i){
+            try{
+                batch[i].promise.set_exception(error);
+            }catch(const std::future_error&){
+                // value already set for this request
+            }
+        }
+    }
+}
+
+void test_batch_scheduler(VariationalLm* pt_model,
+                          const std::vector<std::vector<int> >& data,
+                          const unsigned int& num_sents,
+                          const unsigned int& max_batch_size,
+                          const unsigned int& max_latency_ms,
+                          const unsigned int& num_clients)
+{
+    /*
+    * Submits num_sents sents of data from num_clients threads, then checks
+    * each result against the unbatched VariationalLm::score.
+    * Aborts if they differ.
+    */
+
+    unsigned int num_tested = std::min<size_t>(num_sents, data.size());
+    std::vector<std::future<SCORE_RESULT_t> > futures(num_tested);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        BatchScheduler scheduler(pt_model, max_batch_size, max_latency_ms);
+        std::vector<std::thread> clients;
+        for(unsigned int c=0; c<num_clients; ++c){
+            clients.push_back(std::thread([&, c](){
+                for(unsigned int i=c; i<num_tested; i+=num_clients){
+                    futures[i] = scheduler.submit(data[i]);
+                }
+            }));
+        }
+        for(size_t c=0; c<clients.size(); ++c){
+            clients[c].join();
+        }
+        for(unsigned int i=0; i<num_tested; ++i){
+            futures[i].wait();
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    bool has_scoring_error = false;
+    for(unsigned int i=0; i<num_tested; ++i){
+        SCORE_RESULT_t result = futures[i].get();
+
+        float enc_error = 0.f;
+        float dec_error = pt_model->score(data[i], &enc_error);
+
+        if(!scores_match(dec_error, result.dec_error) || !scores_match(enc_error, result.enc_error)){
+            has_scoring_error = true;
+            std::cout << "ERROR: batched score does not match unbatched score for sent " << i
+                      << " : batched = " << result.enc_error << ", " << result.dec_error
+                      << " unbatched = " << enc_error << ", " << dec_error
+                      << std::endl;
+        }
+    }
+
+    if(has_scoring_error){
+        abort();
+    }
+
+    std::cout << "Test passed. Batched scores match unbatched scores for " << num_tested
+              << " sents, sents/sec = " << (num_tested / elapsed.count()) << std::endl;
+}
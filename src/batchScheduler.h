@@ -0,0 +1,91 @@
+#ifndef BATCH_SCHEDULER_H
+#define BATCH_SCHEDULER_H
+
+#include "variationalLm.h"
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+typedef struct ScoreResult{
+    std::vector<float> mu;     // mean of the latent var
+    std::vector<float> logvar; // log variance of the latent var
+    float enc_error;           // KL error of the encoder
+    float dec_error;           // neg log likelihood of the sent decoded from z = mu
+} SCORE_RESULT_t;
+
+class BatchScheduler{
+
+/*
+* Queues sentences submitted from any number of client threads, groups them
+* by length bucket and scores each group with a single computation graph.
+*
+* A bucket is flushed when it holds max_batch_size requests or when its
+* oldest request has waited max_latency_ms, whichever comes first.
+* Overdue buckets are flushed before full ones to bound the tail latency.
+*
+* Sents of the same length are scored as one dynet minibatch
+* (VariationalLm::encode_batch/decode_batch).
+*
+* All dynet calls are made from the scheduler's worker thread. dynet allows a
+* single live computation graph, so the model must not be trained or used
+* elsewhere while the scheduler is running.
+*/
+
+public:
+
+explicit BatchScheduler(VariationalLm* pt_model,
+                        unsigned int max_batch_size,
+                        unsigned int max_latency_ms,
+                        unsigned int bucket_width=1);
+
+~BatchScheduler();
+
+std::future<SCORE_RESULT_t> submit(const std::vector<int>& sent);
+
+// Flushes all pending requests and joins the worker thread
+void stop();
+
+private:
+
+typedef struct PendingRequest{
+    std::vector<int> sent;
+    std::promise<SCORE_RESULT_t> promise;
+    std::chrono::steady_clock::time_point arrival;
+} PENDING_REQUEST_t;
+
+void run();
+
+void run_batch(std::vector<PENDING_REQUEST_t>* pt_batch);
+
+VariationalLm* d_pt_model;
+
+unsigned int d_max_batch_size;
+std::chrono::milliseconds d_max_latency;
+unsigned int d_bucket_width; // sentence lengths per bucket
+
+// bucket id --> pending requests in arrival order
+std::map<unsigned int, std::deque<PENDING_REQUEST_t> > d_buckets;
+unsigned int d_num_pending;
+bool d_stopped;
+
+std::mutex d_mutex;
+std::condition_variable d_cv;
+std::thread d_worker;
+};
+
+// Scores num_sents sents of data through a scheduler from num_clients
+// threads and aborts if any result differs from VariationalLm::score
+void test_batch_scheduler(VariationalLm* pt_model,
+                          const std::vector<std::vector<int> >& data,
+                          const unsigned int& num_sents,
+                          const unsigned int& max_batch_size,
+                          const unsigned int& max_latency_ms,
+                          const unsigned int& num_clients=4);
+
+#endif
@@ -0,0 +1,432 @@
+#include "frozenLm.h"
+#include "frozenLmFormat.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace{
+
+/*
+* Kernels. Written with independent accumulators and contiguous rows so that
+* the compiler emits packed SIMD code under -Ofast -march=native.
+*/
+
+inline float dot(const float* __restrict__ a, const float* __restrict__ b, unsigned int n)
+{
+    float acc0 = 0.f, acc1 = 0.f, acc2 = 0.f, acc3 = 0.f;
+    unsigned int i = 0;
+    for(; i+4<=n; i+=4){
+        acc0 += a[i]     * b[i];
+        acc1 += a[i + 1] * b[i + 1];
+        acc2 += a[i + 2] * b[i + 2];
+        acc3 += a[i + 3] * b[i + 3];
+    }
+    for(; i<n; ++i){
+        acc0 += a[i] * b[i];
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+// out += W * x, W is row-major {rows, cols}
+inline void matvec_add(float* __restrict__ out,
+                       const float* __restrict__ W,
+                       const float* __restrict__ x,
+                       unsigned int rows,
+                       unsigned int cols)
+{
+    for(unsigned int r=0; r<rows; ++r){
+        out[r] += dot(W + static_cast<size_t>(r) * cols, x, cols);
+    }
+}
+
+// out = b + W * x
+inline void affine(float* __restrict__ out,
+                   const float* __restrict__ b,
+                   const float* __restrict__ W,
+                   const float* __restrict__ x,
+                   unsigned int rows,
+                   unsigned int cols)
+{
+    memcpy(out, b, rows * sizeof(float));
+    matvec_add(out, W, x, rows, cols);
+}
+
+inline float sigmoid(float x)
+{
+    return 1.f / (1.f + expf(-x));
+}
+
+}
+
+FrozenLm::FrozenLm(const std::string& file_path)
+    : d_pt_data(NULL)
+      , d_file_size(0)
+      , d_pt_header(NULL)
+{
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if(fd < 0){
+        std::cout << "Could not open file" << file_path << std::endl;
+        exit(1);
+    }
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0 ||
+           static_cast<size_t>(file_stat.st_size) < sizeof(FrozenLmFormat::HEADER_t)){
+        std::cout << "Not a frozen model file: " << file_path << std::endl;
+        exit(1);
+    }
+    d_file_size = file_stat.st_size;
+
+    d_pt_data = mmap(NULL, d_file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(d_pt_data == MAP_FAILED){
+        std::cout << "Could not mmap file" << file_path << std::endl;
+        exit(1);
+    }
+
+    d_pt_header = static_cast<const FrozenLmFormat::HEADER_t*>(d_pt_data);
+    if(memcmp(d_pt_header->magic, FrozenLmFormat::MAGIC, sizeof(FrozenLmFormat::MAGIC)) != 0 ||
+           d_pt_header->version != FrozenLmFormat::VERSION ||
+           d_pt_header->file_size != d_file_size){
+        std::cout << "Not a frozen model file or unsupported version: " << file_path << std::endl;
+        exit(1);
+    }
+
+    this->check_layout();
+
+    // weights
+    d_lookup = this->tensor(FrozenLmFormat::LOOKUP);
+    this->load_gru(&d_source_rnn, FrozenLmFormat::SOURCE_RNN);
+    this->load_gru(&d_target_rnn, FrozenLmFormat::TARGET_RNN);
+
+    // dict
+    const char* base = static_cast<const char*>(d_pt_data);
+    d_word_offsets = reinterpret_cast<const uint64_t*>(base + d_pt_header->dict_offset);
+    d_word_chars = reinterpret_cast<const char*>(d_word_offsets + d_pt_header->vocab_size + 1);
+    d_word_to_id.reserve(d_pt_header->vocab_size);
+    for(unsigned int i=0; i<d_pt_header->vocab_size; ++i){
+        d_word_to_id[this->word(i)] = i;
+    }
+
+    // scratch buffers
+    unsigned int hidden_dim = d_pt_header->hidden_dim;
+    d_h.resize(hidden_dim);
+    d_gate_z.resize(hidden_dim);
+    d_gate_r.resize(hidden_dim);
+    d_candidate.resize(hidden_dim);
+    d_h2.resize(d_pt_header->hidden2_dim);
+    d_mu.resize(d_pt_header->latent_dim);
+    d_logvar.resize(d_pt_header->latent_dim);
+    d_logits.resize(d_pt_header->vocab_size);
+}
+
+FrozenLm::~FrozenLm()
+{
+    if(d_pt_data != NULL){
+        munmap(d_pt_data, d_file_size);
+    }
+}
+
+uint64_t FrozenLm::tensor_size(unsigned int tensor_id) const
+{
+    uint64_t input_dim = d_pt_header->input_dim;
+    uint64_t hidden_dim = d_pt_header->hidden_dim;
+    uint64_t hidden2_dim = d_pt_header->hidden2_dim;
+    uint64_t latent_dim = d_pt_header->latent_dim;
+    uint64_t vocab_size = d_pt_header->vocab_size;
+
+    if(tensor_id >= FrozenLmFormat::SOURCE_RNN && tensor_id < FrozenLmFormat::W_HH2){
+        tensor_id = tensor_id - FrozenLmFormat::SOURCE_RNN + FrozenLmFormat::TARGET_RNN;
+    }
+    if(tensor_id >= FrozenLmFormat::TARGET_RNN && tensor_id < FrozenLmFormat::W_HV){
+        // {x2*, h2*, b*} for each gate
+        switch((tensor_id - FrozenLmFormat::TARGET_RNN) % 3){
+            case 0: return hidden_dim * input_dim;
+            case 1: return hidden_dim * hidden_dim;
+            default: return hidden_dim;
+        }
+    }
+
+    switch(tensor_id){
+        case FrozenLmFormat::LOOKUP: return vocab_size * input_dim;
+        case FrozenLmFormat::W_HH2:  return hidden2_dim * hidden_dim;
+        case FrozenLmFormat::B_H2:   return hidden2_dim;
+        case FrozenLmFormat::W_H2M:  return latent_dim * hidden2_dim;
+        case FrozenLmFormat::B_M:    return latent_dim;
+        case FrozenLmFormat::W_H2S:  return latent_dim * hidden2_dim;
+        case FrozenLmFormat::B_S:    return latent_dim;
+        case FrozenLmFormat::W_ZH0:  return hidden_dim * latent_dim;
+        case FrozenLmFormat::B_H0:   return hidden_dim;
+        case FrozenLmFormat::W_HV:   return vocab_size * hidden_dim;
+        case FrozenLmFormat::B_V:    return vocab_size;
+        default:
+            std::cout << "Unknown tensor " << tensor_id << std::endl;
+            abort();
+    }
+}
+
+void FrozenLm::check_layout() const
+{
+    /*
+    * Checks every extent against the file size so that a corrupt file
+    * aborts here instead of reading out of bounds later.
+    */
+
+    const FrozenLmFormat::HEADER_t& header = *d_pt_header;
+    uint64_t file_size = d_file_size;
+
+    if(header.input_dim == 0 || header.hidden_dim == 0 || header.hidden2_dim == 0 ||
+           header.latent_dim == 0 || header.vocab_size == 0){
+        std::cout << "Corrupt frozen model: zero dimension" << std::endl;
+        abort();
+    }
+
+    int32_t special_ids[3] = {header.bos_id, header.eos_id, header.unk_id};
+    for(unsigned int i=0; i<3; ++i){
+        if(special_ids[i] < -1 || special_ids[i] >= static_cast<int64_t>(header.vocab_size)){
+            std::cout << "Corrupt frozen model: bad special word id " << special_ids[i] << std::endl;
+            abort();
+        }
+    }
+
+    for(unsigned int i=0; i<FrozenLmFormat::NUM_TENSORS; ++i){
+        uint64_t offset = header.tensor_offsets[i];
+        uint64_t num_bytes = this->tensor_size(i) * sizeof(float);
+        if(offset < sizeof(FrozenLmFormat::HEADER_t) || offset % FrozenLmFormat::ALIGNMENT != 0 ||
+               offset > file_size || num_bytes > file_size - offset){
+            std::cout << "Corrupt frozen model: bad extent for tensor " << i << std::endl;
+            abort();
+        }
+    }
+
+    uint64_t num_offset_bytes = (static_cast<uint64_t>(header.vocab_size) + 1) * sizeof(uint64_t);
+    if(header.dict_offset < sizeof(FrozenLmFormat::HEADER_t) ||
+           header.dict_offset % sizeof(uint64_t) != 0 ||
+           header.dict_offset > file_size || num_offset_bytes > file_size - header.dict_offset){
+        std::cout << "Corrupt frozen model: bad dict offset" << std::endl;
+        abort();
+    }
+
+    const uint64_t* word_offsets = reinterpret_cast<const uint64_t*>(
+                         static_cast<const char*>(d_pt_data) + header.dict_offset);
+    uint64_t chars_offset = header.dict_offset + num_offset_bytes;
+    if(word_offsets[0] != 0){
+        std::cout << "Corrupt frozen model: bad dict" << std::endl;
+        abort();
+    }
+    for(unsigned int i=0; i<header.vocab_size; ++i){
+        if(word_offsets[i + 1] < word_offsets[i]){
+            std::cout << "Corrupt frozen model: bad dict" << std::endl;
+            abort();
+        }
+    }
+    if(word_offsets[header.vocab_size] > file_size - chars_offset){
+        std::cout << "Corrupt frozen model: dict past the end of the file" << std::endl;
+        abort();
+    }
+}
+
+const float* FrozenLm::tensor(unsigned int tensor_id) const
+{
+    // Extents are checked once in check_layout
+    uint64_t offset = d_pt_header->tensor_offsets[tensor_id];
+    return reinterpret_cast<const float*>(static_cast<const char*>(d_pt_data) + offset);
+}
+
+void FrozenLm::load_gru(GRU_t* pt_gru, unsigned int first_tensor_id)
+{
+    for(unsigned int gate=0; gate<3; ++gate){
+        pt_gru->W_x[gate] = this->tensor(first_tensor_id + 3 * gate);
+        pt_gru->W_h[gate] = this->tensor(first_tensor_id + 3 * gate + 1);
+        pt_gru->b[gate] = this->tensor(first_tensor_id + 3 * gate + 2);
+    }
+}
+
+int FrozenLm::word_id(const std::string& word) const
+{
+    std::unordered_map<std::string, int>::const_iterator it = d_word_to_id.find(word);
+    if(it == d_word_to_id.end()){
+        return d_pt_header->unk_id;
+    }
+    return it->second;
+}
+
+std::string FrozenLm::word(int id) const
+{
+    id = this->check_word_id(id);
+    return std::string(d_word_chars + d_word_offsets[id],
+                       d_word_offsets[id + 1] - d_word_offsets[id]);
+}
+
+int FrozenLm::check_word_id(int id) const
+{
+    if(id >= 0 && static_cast<unsigned int>(id) < d_pt_header->vocab_size){
+        return id;
+    }
+    if(d_pt_header->unk_id < 0){
+        std::cout << "word id out of range and no unk in the dict: " << id << std::endl;
+        abort();
+    }
+    return d_pt_header->unk_id;
+}
+
+void FrozenLm::gru_step(const GRU_t& gru, const float* x, float* h)
+{
+    /*
+    * Same as dynet::GRUBuilder:
+    * z = sigmoid(bz + X2Z x + H2Z h)
+    * r = sigmoid(br + X2R x + H2R h)
+    * c = tanh(bh + X2H x + H2H (r . h))
+    * h = (1 - z) . h + z . c
+    */
+
+    unsigned int input_dim = d_pt_header->input_dim;
+    unsigned int hidden_dim = d_pt_header->hidden_dim;
+    float* z = d_gate_z.data();
+    float* r = d_gate_r.data();
+    float* c = d_candidate.data();
+
+    affine(z, gru.b[0], gru.W_x[0], x, hidden_dim, input_dim);
+    matvec_add(z, gru.W_h[0], h, hidden_dim, hidden_dim);
+    affine(r, gru.b[1], gru.W_x[1], x, hidden_dim, input_dim);
+    matvec_add(r, gru.W_h[1], h, hidden_dim, hidden_dim);
+    for(unsigned int i=0; i<hidden_dim; ++i){
+        z[i] = sigmoid(z[i]);
+        r[i] = sigmoid(r[i]) * h[i];
+    }
+
+    affine(c, gru.b[2], gru.W_x[2], x, hidden_dim, input_dim);
+    matvec_add(c, gru.W_h[2], r, hidden_dim, hidden_dim);
+    for(unsigned int i=0; i<hidden_dim; ++i){
+        h[i] += z[i] * (tanhf(c[i]) - h[i]);
+    }
+}
+
+void FrozenLm::output_logits(const float* h, unsigned int num_words)
+{
+    // Rows are words, so the first num_words rows are a contiguous block
+    affine(d_logits.data(),
+           this->tensor(FrozenLmFormat::B_V),
+           this->tensor(FrozenLmFormat::W_HV),
+           h,
+           num_words,
+           d_pt_header->hidden_dim);
+}
+
+void FrozenLm::encode(const std::vector<int>& sent, float* mu, float* logvar)
+{
+    unsigned int input_dim = d_pt_header->input_dim;
+    unsigned int hidden_dim = d_pt_header->hidden_dim;
+    unsigned int hidden2_dim = d_pt_header->hidden2_dim;
+    unsigned int latent_dim = d_pt_header->latent_dim;
+
+    float* h = d_h.data();
+    std::fill(d_h.begin(), d_h.end(), 0.f);
+    for(size_t i=0; i<sent.size(); ++i){
+        const float* x = d_lookup + static_cast<size_t>(this->check_word_id(sent[i])) * input_dim;
+        this->gru_step(d_source_rnn, x, h);
+    }
+
+    // h-->h2
+    float* h2 = d_h2.data();
+    affine(h2, this->tensor(FrozenLmFormat::B_H2), this->tensor(FrozenLmFormat::W_HH2),
+           h, hidden2_dim, hidden_dim);
+    for(unsigned int i=0; i<hidden2_dim; ++i){
+        h2[i] = tanhf(h2[i]);
+    }
+
+    // h2-->m, h2-->s
+    affine(mu, this->tensor(FrozenLmFormat::B_M), this->tensor(FrozenLmFormat::W_H2M),
+           h2, latent_dim, hidden2_dim);
+    affine(logvar, this->tensor(FrozenLmFormat::B_S), this->tensor(FrozenLmFormat::W_H2S),
+           h2, latent_dim, hidden2_dim);
+}
+
+float FrozenLm::score(const std::vector<int>& sent, float* pt_enc_error)
+{
+    unsigned int input_dim = d_pt_header->input_dim;
+    unsigned int hidden_dim = d_pt_header->hidden_dim;
+    unsigned int latent_dim = d_pt_header->latent_dim;
+    unsigned int vocab_size = d_pt_header->vocab_size;
+
+    float* mu = d_mu.data();
+    float* logvar = d_logvar.data();
+    this->encode(sent, mu, logvar);
+
+    if(pt_enc_error != NULL){
+        // KL Error: See Doersch's paper
+        float kl = 0.f;
+        for(unsigned int i=0; i<latent_dim; ++i){
+            kl += expf(logvar[i]) + mu[i] * mu[i] - 1.f - logvar[i];
+        }
+        *pt_enc_error = 0.5f * kl;
+    }
+
+    // z-->h0
+    float* h = d_h.data();
+    affine(h, this->tensor(FrozenLmFormat::B_H0), this->tensor(FrozenLmFormat::W_ZH0),
+           mu, hidden_dim, latent_dim);
+
+    float dec_error = 0.f;
+    for(size_t t=0; t+1<sent.size(); ++t){
+        const float* x = d_lookup + static_cast<size_t>(this->check_word_id(sent[t])) * input_dim;
+        this->gru_step(d_target_rnn, x, h);
+        this->output_logits(h, vocab_size);
+
+        // -log softmax(v)[next_word_id]
+        const float* logits = d_logits.data();
+        float max_logit = *std::max_element(logits, logits + vocab_size);
+        float sum_exp = 0.f;
+        for(unsigned int i=0; i<vocab_size; ++i){
+            sum_exp += expf(logits[i] - max_logit);
+        }
+        dec_error += max_logit + logf(sum_exp) - logits[this->check_word_id(sent[t + 1])];
+    }
+
+    return dec_error;
+}
+
+void FrozenLm::generate(const float* z,
+                        unsigned int max_len,
+                        std::vector<int>* pt_sent,
+                        unsigned int head_size)
+{
+    if(d_pt_header->bos_id < 0 || d_pt_header->eos_id < 0){
+        std::cout << "Cannot generate: <bos> or <eos> not in the dict" << std::endl;
+        abort();
+    }
+
+    if(head_size == 0 || head_size > d_pt_header->vocab_size){
+        head_size = d_pt_header->vocab_size;
+    }
+
+    unsigned int input_dim = d_pt_header->input_dim;
+    unsigned int hidden_dim = d_pt_header->hidden_dim;
+    unsigned int latent_dim = d_pt_header->latent_dim;
+
+    // z-->h0
+    float* h = d_h.data();
+    affine(h, this->tensor(FrozenLmFormat::B_H0), this->tensor(FrozenLmFormat::W_ZH0),
+           z, hidden_dim, latent_dim);
+
+    std::vector<int>& sent = *pt_sent;
+    sent.clear();
+    sent.push_back(d_pt_header->bos_id);
+    while(sent.size() < max_len && sent.back() != d_pt_header->eos_id){
+        const float* x = d_lookup + static_cast<size_t>(sent.back()) * input_dim;
+        this->gru_step(d_target_rnn, x, h);
+        this->output_logits(h, head_size);
+
+        const float* logits = d_logits.data();
+        sent.push_back(std::max_element(logits, logits + head_size) - logits);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef FROZEN_LM_H
+#define FROZEN_LM_H
+
+#include "frozenLmFormat.h"
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <stddef.h>
+
+class FrozenLm{
+
+/*
+* Inference engine for a VariationalLm exported with
+* VariationalLm::export_frozen. Does not depend on dynet.
+*
+* The file is memory-mapped read only, so processes loading the same file
+* share one page-cached copy of the weights. All scratch buffers are
+* allocated in the constructor; encode/score/generate do not allocate
+* (except to grow the output of generate).
+*
+* Not thread safe: use one FrozenLm per thread.
+*/
+
+public:
+
+explicit FrozenLm(const std::string& file_path);
+
+~FrozenLm();
+
+FrozenLm(const FrozenLm&) = delete;
+FrozenLm& operator=(const FrozenLm&) = delete;
+
+// x --> {mu, logvar}. mu and logvar must hold latent_dim() floats.
+void encode(const std::vector<int>& sent, float* mu, float* logvar);
+
+// neg log likelihood of the sent decoded from z = mu
+// If pt_enc_error is not null, it is set to the KL error of the encoder.
+float score(const std::vector<int>& sent, float* pt_enc_error=NULL);
+
+// Greedy decoding from z, starting at <bos> and stopping at <eos> or max_len.
+// If head_size is not 0, only the first head_size words are scored at each
+// step. This is a shortlist of the most frequent words when the dict was
+// built by PtbReader::get_ptb_data_parallel; <eos> must be in it.
+void generate(const float* z,
+              unsigned int max_len,
+              std::vector<int>* pt_sent,
+              unsigned int head_size=0);
+
+int word_id(const std::string& word) const;
+
+std::string word(int id) const;
+
+unsigned int latent_dim() const { return d_pt_header->latent_dim; }
+unsigned int vocab_size() const { return d_pt_header->vocab_size; }
+
+private:
+
+typedef struct Gru{
+    const float* W_x[3]; // input  --> {z, r, h}
+    const float* W_h[3]; // hidden --> {z, r, h}
+    const float* b[3];
+} GRU_t;
+
+// Aborts unless every tensor and the dict lie inside the file
+void check_layout() const;
+
+// number of floats in the tensor, from the header dims
+uint64_t tensor_size(unsigned int tensor_id) const;
+
+const float* tensor(unsigned int tensor_id) const;
+
+void load_gru(GRU_t* pt_gru, unsigned int first_tensor_id);
+
+// h = gru(x, h). Uses d_gate_z, d_gate_r, d_candidate as scratch.
+void gru_step(const GRU_t& gru, const float* x, float* h);
+
+// h --> d_logits, for the first num_words words
+void output_logits(const float* h, unsigned int num_words);
+
+int check_word_id(int id) const;
+
+// memory-mapped file
+void* d_pt_data;
+size_t d_file_size;
+const FrozenLmFormat::HEADER_t* d_pt_header;
+
+// weights
+const float* d_lookup;
+GRU_t d_source_rnn;
+GRU_t d_target_rnn;
+
+// dict
+const uint64_t* d_word_offsets;
+const char* d_word_chars;
+std::unordered_map<std::string, int> d_word_to_id;
+
+// scratch buffers
+std::vector<float> d_h;
+std::vector<float> d_gate_z;
+std::vector<float> d_gate_r;
+std::vector<float> d_candidate;
+std::vector<float> d_h2;
+std::vector<float> d_mu;
+std::vector<float> d_logvar;
+std::vector<float> d_logits;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef FROZEN_LM_FORMAT_H
+#define FROZEN_LM_FORMAT_H
+
+#include <stdint.h>
+
+namespace FrozenLmFormat{
+
+/*
+* Layout of a frozen VariationalLm file:
+*
+*   HEADER_t
+*   tensors, each starting at a multiple of ALIGNMENT bytes
+*   dict: uint64_t word_offsets[vocab_size + 1] followed by the word chars
+*
+* All offsets are in bytes from the start of the file. Matrices are stored
+* row-major (dynet stores them column-major) so that a matrix-vector product
+* reads each row contiguously. The lookup table is stored one embedding per
+* row. Only single layer rnns are supported.
+*/
+
+const char MAGIC[8] = {'V', 'A', 'E', 'L', 'M', 'F', 'Z', '\0'};
+const uint32_t VERSION = 1;
+const uint64_t ALIGNMENT = 64;
+
+// GRU params in the order they are added by dynet::GRUBuilder
+enum GruTensor{
+    X2Z = 0, H2Z, BZ,
+    X2R, H2R, BR,
+    X2H, H2H, BH,
+    NUM_GRU_TENSORS
+};
+
+enum Tensor{
+    LOOKUP = 0,
+
+    SOURCE_RNN,                               // encoder GRU, NUM_GRU_TENSORS entries
+    W_HH2 = SOURCE_RNN + NUM_GRU_TENSORS,
+    B_H2,
+    W_H2M,
+    B_M,
+    W_H2S,
+    B_S,
+
+    W_ZH0,
+    B_H0,
+    TARGET_RNN,                               // decoder GRU, NUM_GRU_TENSORS entries
+    W_HV = TARGET_RNN + NUM_GRU_TENSORS,
+    B_V,
+
+    NUM_TENSORS
+};
+
+typedef struct Header{
+    char magic[8];
+    uint32_t version;
+
+    // dimensions
+    uint32_t input_dim;
+    uint32_t hidden_dim;
+    uint32_t hidden2_dim;
+    uint32_t latent_dim;
+    uint32_t vocab_size;
+
+    // special word ids, -1 if not in the dict
+    int32_t bos_id;
+    int32_t eos_id;
+    int32_t unk_id;
+    uint32_t padding;
+
+    uint64_t tensor_offsets[NUM_TENSORS];
+    uint64_t dict_offset;
+    uint64_t file_size;
+} HEADER_t;
+
+inline uint64_t align_offset(uint64_t offset)
+{
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+} // FrozenLmFormat
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef LM_TRAINER_H
+#define LM_TRAINER_H
+
+#include "ptbReader.h"
+
+#include "dynet/io.h"
+#include "dynet/expr.h"
+#include "dynet/model.h"
+#include "dynet/training.h"
+#include "dynet/dict.h"
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <limits>
+#include <chrono>
+#include <algorithm>
+#include <math.h>
+
+/*
+* Loss combination policies for LmTrainer.
+* Each builds the training error of one sent and its decoder (reconstruction)
+* error, which is used for the perplexity.
+*/
+
+// KL error of the encoder + decoder error.
+// Model must have forward(sp_cg, sp_enc_error, sp_dec_error, sent).
+struct KlLoss{
+    template<class Model>
+    static void forward(Model* pt_model,
+                        std::shared_ptr<dynet::ComputationGraph> sp_cg,
+                        std::shared_ptr<dynet::Expression> sp_enc_error,
+                        std::shared_ptr<dynet::Expression> sp_dec_error,
+                        const std::vector<int>& sent,
+                        dynet::Expression* pt_tot_error)
+    {
+        pt_model->forward(sp_cg, sp_enc_error, sp_dec_error, sent);
+        *pt_tot_error = (*sp_enc_error) + (*sp_dec_error);
+    }
+};
+
+// Decoder error only, for models without a latent var.
+// Model must have forward(sp_cg, sp_error, sent).
+struct NoKlLoss{
+    template<class Model>
+    static void forward(Model* pt_model,
+                        std::shared_ptr<dynet::ComputationGraph> sp_cg,
+                        std::shared_ptr<dynet::Expression> /* sp_enc_error */,
+                        std::shared_ptr<dynet::Expression> sp_dec_error,
+                        const std::vector<int>& sent,
+                        dynet::Expression* pt_tot_error)
+    {
+        pt_model->forward(sp_cg, sp_dec_error, sent);
+        *pt_tot_error = *sp_dec_error;
+    }
+};
+
+template<class Model, class LossPolicy>
+class LmTrainer{
+
+/*
+* Batched training loop shared by RnnLm and VariationalLm.
+* The loss policy is a template param so the inner loop has no virtual calls.
+*
+* If checkpoint_file is not empty, the params are saved there with
+* dynet::TextFileSaver whenever the validation error improves. If pt_dict
+* is not null, it is saved with them to
+* PtbReader::get_checkpoint_dict_file(checkpoint_file).
+*/
+
+public:
+
+explicit LmTrainer(Model* pt_model,
+                   std::shared_ptr<dynet::ParameterCollection> sp_model,
+                   const std::string& checkpoint_file="",
+                   const dynet::Dict* pt_dict=NULL)
+    : d_pt_model(pt_model)
+      , d_sp_model(sp_model)
+      , d_checkpoint_file(checkpoint_file)
+      , d_pt_dict(pt_dict)
+{
+}
+
+void train(std::vector<std::vector<int> >* pt_train_data,
+           std::vector<std::vector<int> >* pt_valid_data,
+           const unsigned int& max_epochs,
+           const std::map<unsigned int, unsigned int>& batch_size_for_length);
+
+// Same as above with the same batch size for every length
+void train(std::vector<std::vector<int> >* pt_train_data,
+           std::vector<std::vector<int> >* pt_valid_data,
+           const unsigned int& max_epochs,
+           const unsigned int& batch_size);
+
+typedef struct BatchLoss{
+    double tot_loss;
+    double dec_loss;
+    unsigned int words;
+} BATCH_LOSS_t;
+
+// Builds the batch in a new graph and evaluates it.
+// Runs backward and updates the params if pt_trainer is not null.
+// This is the training step, also timed by MemoryCalibrator::calibrate.
+void run_batch(BATCH_LOSS_t* pt_loss,
+               const std::vector<const std::vector<int>*>& batch,
+               dynet::Trainer* pt_trainer);
+
+private:
+
+// Same as above for the sents of batchIndex in data
+void run_batch(BATCH_LOSS_t* pt_loss,
+               const std::vector<std::vector<int> >& data,
+               const PtbReader::BATCH_INDEX_t& batchIndex,
+               dynet::Trainer* pt_trainer);
+
+Model* d_pt_model;
+std::shared_ptr<dynet::ParameterCollection> d_sp_model;
+std::string d_checkpoint_file;
+const dynet::Dict* d_pt_dict;
+};
+
+template<class Model, class LossPolicy>
+void LmTrainer<Model, LossPolicy>::run_batch(BATCH_LOSS_t* pt_loss,
+                                             const std::vector<const std::vector<int>*>& batch,
+                                             dynet::Trainer* pt_trainer)
+{
+    std::shared_ptr<dynet::ComputationGraph> sp_cg =
+                         std::make_shared<dynet::ComputationGraph>();
+    std::shared_ptr<dynet::Expression> sp_enc_err = std::make_shared<dynet::Expression>();
+    std::shared_ptr<dynet::Expression> sp_dec_err = std::make_shared<dynet::Expression>();
+    std::vector<dynet::Expression> tot_losses_expression;
+    std::vector<dynet::Expression> dec_losses_expression;
+    dynet::Expression tot_err;
+    pt_loss->words = 0;
+    for(size_t i=0; i<batch.size(); ++i){
+        LossPolicy::forward(d_pt_model, sp_cg, sp_enc_err, sp_dec_err, *batch[i], &tot_err);
+        tot_losses_expression.push_back(tot_err);
+        dec_losses_expression.push_back(*sp_dec_err);
+        pt_loss->words += batch[i]->size();
+    }
+
+    // Calculate the loss and update trainer
+    dynet::Expression tot_loss_expression = dynet::sum(tot_losses_expression);
+    pt_loss->tot_loss = dynet::as_scalar(sp_cg->forward(tot_loss_expression));
+    if(pt_trainer != NULL){
+        sp_cg->backward(tot_loss_expression);
+        pt_trainer->update();
+    }
+
+    // Calculate the dec loss
+    dynet::Expression dec_loss_expression = dynet::sum(dec_losses_expression);
+    pt_loss->dec_loss = dynet::as_scalar(dec_loss_expression.value());
+}
+
+template<class Model, class LossPolicy>
+void LmTrainer<Model, LossPolicy>::run_batch(BATCH_LOSS_t* pt_loss,
+                                             const std::vector<std::vector<int> >& data,
+                                             const PtbReader::BATCH_INDEX_t& batchIndex,
+                                             dynet::Trainer* pt_trainer)
+{
+    std::vector<const std::vector<int>*> batch;
+    for(unsigned int sent_idx=batchIndex.batch_begin_idx;
+            sent_idx<batchIndex.batch_begin_idx + batchIndex.batch_num_elements;
+            ++sent_idx){
+        batch.push_back(&data[sent_idx]);
+    }
+    this->run_batch(pt_loss, batch, pt_trainer);
+}
+
+template<class Model, class LossPolicy>
+void LmTrainer<Model, LossPolicy>::train(std::vector<std::vector<int> >* pt_train_data,
+                                         std::vector<std::vector<int> >* pt_valid_data,
+                                         const unsigned int& max_epochs,
+                                         const std::map<unsigned int, unsigned int>& batch_size_for_length)
+{
+    // Prepare train data for batching
+    std::vector<std::vector<int> >& train_data = *pt_train_data;
+    PtbReader::sort_data_in_ascending_length(&train_data);
+    std::vector<PtbReader::BATCH_INDEX_t> batchIndexListTrain;
+    PtbReader::create_batches(&batchIndexListTrain, train_data, batch_size_for_length);
+
+    // Prepare valid data for batching
+    std::vector<std::vector<int> >& valid_data = *pt_valid_data;
+    PtbReader::sort_data_in_ascending_length(&valid_data);
+    std::vector<PtbReader::BATCH_INDEX_t> batchIndexListValid;
+    PtbReader::create_batches(&batchIndexListValid, valid_data, batch_size_for_length);
+
+    dynet::AdamTrainer trainer(*d_sp_model);
+    double best_valid_loss = std::numeric_limits<double>::max();
+    BATCH_LOSS_t batch_loss;
+    for(unsigned int current_epoch=0; current_epoch<max_epochs; ++current_epoch){
+        unsigned int train_words = 0;
+        double train_loss = 0.0;
+        double dec_loss = 0.0;
+        unsigned int train_samples = 0;
+        std::chrono::steady_clock::time_point epoch_start = std::chrono::steady_clock::now();
+        std::random_shuffle(batchIndexListTrain.begin(), batchIndexListTrain.end());
+        for(unsigned int batch_id=0; batch_id<batchIndexListTrain.size();++batch_id){
+            this->run_batch(&batch_loss, train_data, batchIndexListTrain[batch_id], &trainer);
+            train_loss += batch_loss.tot_loss;
+            dec_loss += batch_loss.dec_loss;
+            train_words += batch_loss.words;
+            train_samples += batchIndexListTrain[batch_id].batch_num_elements;
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - epoch_start;
+            std::cout << " Total E = " << (train_loss / train_words )
+                      << " Decoder E = " << (dec_loss / train_words)
+                      << " ppl = " << std::exp(dec_loss / train_words)
+                      << " lines = " << train_samples
+                      << " words/sec = " << (train_words / elapsed.count())
+                      << " current_epoch = " << current_epoch
+                      << std::endl;
+
+        } // batch_id
+
+        // Validation, no update
+        unsigned int valid_words = 0;
+        double valid_loss = 0.0;
+        double valid_dec_loss = 0.0;
+        for(unsigned int batch_id=0; batch_id<batchIndexListValid.size();++batch_id){
+            this->run_batch(&batch_loss, valid_data, batchIndexListValid[batch_id], NULL);
+            valid_loss += batch_loss.tot_loss;
+            valid_dec_loss += batch_loss.dec_loss;
+            valid_words += batch_loss.words;
+        }
+
+        std::chrono::duration<double> epoch_time = std::chrono::steady_clock::now() - epoch_start;
+        std::cout << "Validation:"
+                  << " Total E = " << (valid_loss / valid_words)
+                  << " Decoder E = " << (valid_dec_loss / valid_words)
+                  << " ppl = " << std::exp(valid_dec_loss / valid_words)
+                  << " epoch time = " << epoch_time.count() << "s"
+                  << " current_epoch = " << current_epoch
+                  << std::endl;
+
+        if(!d_checkpoint_file.empty() && valid_loss < best_valid_loss){
+            best_valid_loss = valid_loss;
+            dynet::TextFileSaver saver(d_checkpoint_file);
+            saver.save(*d_sp_model);
+            if(d_pt_dict != NULL){
+                PtbReader::save_dict(*d_pt_dict, PtbReader::get_checkpoint_dict_file(d_checkpoint_file));
+            }
+            std::cout << "Saved checkpoint to " << d_checkpoint_file << std::endl;
+        }
+    } // current_epoch
+} // train
+
+template<class Model, class LossPolicy>
+void LmTrainer<Model, LossPolicy>::train(std::vector<std::vector<int> >* pt_train_data,
+                                         std::vector<std::vector<int> >* pt_valid_data,
+                                         const unsigned int& max_epochs,
+                                         const unsigned int& batch_size)
+{
+    // A single entry map gives the same batch size for every length
+    std::map<unsigned int, unsigned int> batch_size_for_length;
+    batch_size_for_length[0] = batch_size;
+    this->train(pt_train_data, pt_valid_data, max_epochs, batch_size_for_length);
+}
+
+#endif
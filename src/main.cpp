@@ -1,6 +1,8 @@
 #include "ptbReader.h"
 #include "variationalLm.h"
 #include "rnnLm.h"
+#include "memoryCalibrator.h"
+#include "batchScheduler.h"
 
 #include "dynet/training.h"
 #include "dynet/io.h"
@@ -8,9 +10,11 @@
 #include "dynet/model.h"
 #include "dynet/gru.h"
 #include "dynet/dict.h"
+#include "dynet/init.h"
 
 #include <iostream>
 #include <vector>
+#include <map>
 #include <memory>
 #include <math.h>
 #include <cassert> 
@@ -18,7 +22,14 @@
 std::string PROJECT_PATH = "/home/shantanu/Programming/dynetCppProjects/vaeLm/";
 const std::string PTB_TRAIN_FILE = PROJECT_PATH + "src/ptb_data/ptb_train.txt";
 const std::string PTB_VALID_FILE = PROJECT_PATH + "src/ptb_data/ptb_valid.txt";  
+const std::string FROZEN_MODEL_FILE = PROJECT_PATH + "vaeLm.frozen";
+const std::string VAELM_CHECKPOINT_FILE = PROJECT_PATH + "vaeLm.model";
+const std::string RNNLM_CHECKPOINT_FILE = PROJECT_PATH + "rnnLm.model";
+const std::string CALIBRATION_FILE = PROJECT_PATH + "calibration.txt"; // delete to re-calibrate
 const std::string UNK            = "<unk>"; // as defined in ptb train file
+const unsigned int NUM_READER_THREADS = 0; // 0 for all hardware threads
+const unsigned int MIN_WORD_COUNT = 1;
+const unsigned int MAX_VOCAB_SIZE = 0;     // 0 for no limit
 const unsigned int LAYERS        = 1;
 const unsigned int IMPUT_DIM     = 64;
 const unsigned int HIDDEN_DIM    = 128;
@@ -26,13 +37,22 @@ const unsigned int HIDDEN2_DIM   = 32;
 const unsigned int LATENT_DIM    = 10;
 const unsigned int NOISE_SAMPLES = 1;
 const unsigned int MAX_EPOCHS    = 10;
-const unsigned int BATCH_SIZE    = 16;
+const unsigned int BATCH_SIZE    = 16;  // used when MEMORY_BUDGET_MB is 0
+const unsigned int MAX_BATCH_SIZE = 256; // largest batch size tried by the calibration
+const size_t MEMORY_BUDGET_MB    = 2048; // dynet pools, 0 to skip the calibration
+const bool RUN_RNNLM_BASELINE    = false;
+const bool RUN_SERVING_CHECKS    = false; // check the exported and batched scoring paths after training
+const unsigned int NUM_SCHEDULER_TEST_SENTS = 256;
+const unsigned int SCHEDULER_MAX_BATCH_SIZE = 32;
+const unsigned int SCHEDULER_MAX_LATENCY_MS = 5;
+const unsigned int NUM_FROZEN_TEST_SENTS = 32;
 
 
 
 void run_vaelm(std::vector<std::vector<int> >* pt_ptb_train_data,
                std::vector<std::vector<int> >* pt_ptb_valid_data, 
-               const dynet::Dict& dict)
+               const dynet::Dict& dict,
+               const std::map<unsigned int, unsigned int>& batch_size_for_length)
 {
     std::cout << "running vaeLm" << std::endl;
     
@@ -46,29 +66,125 @@ void run_vaelm(std::vector<std::vector<int> >* pt_ptb_train_data,
                         HIDDEN2_DIM,
                         LATENT_DIM,
                         dict.size());
-    vaeLm.train(pt_ptb_train_data, pt_ptb_valid_data, MAX_EPOCHS, BATCH_SIZE); 
+    vaeLm.train(pt_ptb_train_data, pt_ptb_valid_data, MAX_EPOCHS, batch_size_for_length,
+                VAELM_CHECKPOINT_FILE, &dict); 
+
+    // Export the params of the best validation epoch, not of the last one,
+    // with the dict saved with them
+    dynet::TextFileLoader loader(VAELM_CHECKPOINT_FILE);
+    loader.populate(*sp_model);
+    dynet::Dict checkpoint_dict;
+    PtbReader::load_dict(&checkpoint_dict, PtbReader::get_checkpoint_dict_file(VAELM_CHECKPOINT_FILE), UNK);
+    vaeLm.export_frozen(FROZEN_MODEL_FILE, checkpoint_dict);
+
+    // Check the exported and batched scoring paths used for serving
+    if(RUN_SERVING_CHECKS){
+        test_frozen_export(&vaeLm, FROZEN_MODEL_FILE, *pt_ptb_valid_data, NUM_FROZEN_TEST_SENTS);
+        test_batch_scheduler(&vaeLm, *pt_ptb_valid_data, NUM_SCHEDULER_TEST_SENTS,
+                             SCHEDULER_MAX_BATCH_SIZE, SCHEDULER_MAX_LATENCY_MS);
+    }
+    return;
+}
+
+void run_rnnlm(std::vector<std::vector<int> >* pt_ptb_train_data,
+               std::vector<std::vector<int> >* pt_ptb_valid_data, 
+               const dynet::Dict& dict,
+               const std::map<unsigned int, unsigned int>& batch_size_for_length)
+{
+    std::cout << "running rnnLm" << std::endl;
+    
+    // dynet model
+    std::shared_ptr<dynet::ParameterCollection> sp_model = 
+                          std::make_shared<dynet::ParameterCollection>();
+    RnnLm rnnLm(sp_model, 
+                LAYERS, 
+                IMPUT_DIM, 
+                HIDDEN_DIM, 
+                dict.size());
+    rnnLm.train(pt_ptb_train_data, pt_ptb_valid_data, MAX_EPOCHS, batch_size_for_length,
+                RNNLM_CHECKPOINT_FILE, &dict); 
     return;
 }
 
 int main(int argc, char** argv)
 {
-     // Initialize dynet
+    // dynet is initialized once the pool sizes are known
     dynet::DynetParams dyparams = dynet::extract_dynet_params(argc, argv); 
-    dynet::initialize(dyparams);
 
-    // Read training data and construct dict {word: word_idx}
+    // Read training and validation data concurrently
+    // and construct dict {word: word_idx} from the training data.
+    // The dict is frozen with unk set.
     dynet::Dict dict;
     std::vector<std::vector<int> > ptb_train_data;
-    PtbReader::get_ptb_data(&ptb_train_data, &dict, PTB_TRAIN_FILE);
-    // Freeze dict and set unk
-    dict.freeze();
-    dict.set_unk(UNK);
-    PtbReader::log_data_stats(ptb_train_data, dict, "Training data");
-  
-    // Validation data
     std::vector<std::vector<int> > ptb_valid_data;
-    PtbReader::get_ptb_data(&ptb_valid_data, &dict, PTB_VALID_FILE);
-    PtbReader::log_data_stats(ptb_train_data, dict, "Validation data");
+    std::vector<std::vector<std::vector<int> >* > pt_datasets;
+    pt_datasets.push_back(&ptb_train_data);
+    pt_datasets.push_back(&ptb_valid_data);
+    std::vector<std::string> file_paths;
+    file_paths.push_back(PTB_TRAIN_FILE);
+    file_paths.push_back(PTB_VALID_FILE);
+    PtbReader::get_ptb_data_parallel(pt_datasets, &dict, file_paths, 
+                                     NUM_READER_THREADS, MIN_WORD_COUNT, MAX_VOCAB_SIZE, UNK);
+
+    // Word ids are in descending order of frequency (see get_ptb_data_parallel)
+    // so that the rows of frequent words are contiguous at the front of the
+    // embedding and output matrices. The trainers save the dict next to each
+    // checkpoint since the rows follow it.
+    PtbReader::log_data_stats(ptb_train_data, dict, "Training data");
+    PtbReader::log_data_stats(ptb_valid_data, dict, "Validation data");
+
+    // Pick batch sizes and dynet pool sizes for the memory budget.
+    // dynet cannot resize its pools once initialized, so the calibration
+    // is run on its own and saved, and the next run trains with it.
+    std::map<unsigned int, unsigned int> batch_size_for_length;
+    batch_size_for_length[0] = BATCH_SIZE;
+    if(MEMORY_BUDGET_MB > 0){
+        MemoryCalibrator::CALIBRATION_RESULT_t calibration;
+        if(MemoryCalibrator::load_calibration(&calibration, CALIBRATION_FILE)){
+            std::cout << "Using calibration from " << CALIBRATION_FILE << std::endl;
+            batch_size_for_length = calibration.batch_size_for_length;
+            dyparams.mem_descriptor = calibration.mem_descriptor;
+        }else{
+            dynet::initialize(dyparams);
+
+            // Throwaway model of the type to be trained, it is updated while probing
+            std::shared_ptr<dynet::ParameterCollection> sp_model = 
+                                  std::make_shared<dynet::ParameterCollection>();
+            if(RUN_RNNLM_BASELINE){
+                RnnLm rnnLm(sp_model, 
+                            LAYERS, 
+                            IMPUT_DIM, 
+                            HIDDEN_DIM, 
+                            dict.size());
+                MemoryCalibrator::calibrate<RnnLm, NoKlLoss>(&calibration, &rnnLm, sp_model, 
+                                                             ptb_train_data, MEMORY_BUDGET_MB, 
+                                                             MAX_BATCH_SIZE);
+            }else{
+                VariationalLm vaeLm(sp_model, 
+                                    LAYERS, 
+                                    IMPUT_DIM, 
+                                    HIDDEN_DIM, 
+                                    HIDDEN2_DIM,
+                                    LATENT_DIM,
+                                    dict.size());
+                MemoryCalibrator::calibrate<VariationalLm, KlLoss>(&calibration, &vaeLm, sp_model, 
+                                                                   ptb_train_data, MEMORY_BUDGET_MB, 
+                                                                   MAX_BATCH_SIZE);
+            }
+            MemoryCalibrator::log_calibration(calibration);
+            MemoryCalibrator::save_calibration(calibration, CALIBRATION_FILE);
+            std::cout << "Saved calibration to " << CALIBRATION_FILE
+                      << ", run again to train with it" << std::endl;
+            return 0;
+        }
+    }
+
+    // Initialize dynet
+    dynet::initialize(dyparams);
 
-    run_vaelm(&ptb_train_data, &ptb_valid_data, dict);
+    if(RUN_RNNLM_BASELINE){
+        run_rnnlm(&ptb_train_data, &ptb_valid_data, dict, batch_size_for_length);
+    }else{
+        run_vaelm(&ptb_train_data, &ptb_valid_data, dict, batch_size_for_length);
+    }
 }
@@ -0,0 +1,246 @@
+#include "memoryCalibrator.h"
+#include "ptbReader.h"
+
+#include "dynet/globals.h"
+#include "dynet/devices.h"
+#include "dynet/aligned-mem-pool.h"
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+namespace{
+
+const double POOL_HEADROOM = 1.2;  // pool size = measured peak * POOL_HEADROOM
+const size_t BYTES_PER_MB = 1 << 20;
+
+// dynet frees the scratch pool after each node, so its peak cannot be read
+// after a step like the other pools. This is reserved for it instead.
+const size_t SCRATCH_POOL_MB = 32;
+
+size_t pool_used(dynet::DeviceMempool pool)
+{
+    return dynet::default_device->pools[static_cast<int>(pool)]->used();
+}
+
+size_t to_pool_mb(size_t bytes)
+{
+    size_t mb = static_cast<size_t>(bytes * POOL_HEADROOM / BYTES_PER_MB) + 1;
+    return mb;
+}
+
+size_t graph_bytes(const MemoryCalibrator::BUCKET_PROBE_t& probe)
+{
+    return probe.fxs_bytes + probe.dedfs_bytes;
+}
+
+size_t pick_fastest(const std::vector<MemoryCalibrator::BUCKET_PROBE_t>& probes,
+                    const size_t& max_graph_bytes)
+{
+    // Index of the fastest probe within max_graph_bytes, else of the smallest batch
+    size_t best_idx = 0;
+    for(size_t i=0; i<probes.size(); ++i){
+        if(graph_bytes(probes[i]) <= max_graph_bytes &&
+               (graph_bytes(probes[best_idx]) > max_graph_bytes ||
+                probes[i].tokens_per_sec > probes[best_idx].tokens_per_sec)){
+            best_idx = i;
+        }
+    }
+    return best_idx;
+}
+
+}
+
+void MemoryCalibrator::get_probe_lengths(std::vector<unsigned int>* pt_probe_lengths,
+                                         const std::map<unsigned int, unsigned int>& length_counts,
+                                         const unsigned int& max_probe_lengths)
+{
+    std::vector<unsigned int>& probe_lengths = *pt_probe_lengths;
+    probe_lengths.clear();
+
+    size_t num_sents = 0;
+    for(std::map<unsigned int, unsigned int>::const_iterator it=length_counts.begin();
+           it!=length_counts.end(); ++it){
+        num_sents += it->second;
+    }
+
+    if(length_counts.size() <= max_probe_lengths){
+        for(std::map<unsigned int, unsigned int>::const_iterator it=length_counts.begin();
+               it!=length_counts.end(); ++it){
+            probe_lengths.push_back(it->first);
+        }
+        return;
+    }
+
+    std::map<unsigned int, unsigned int>::const_iterator it = length_counts.begin();
+    size_t num_seen = it->second;
+    for(unsigned int k=0; k<max_probe_lengths; ++k){
+        // rank of the k-th quantile sent, the last one is the longest sent
+        size_t rank = (max_probe_lengths == 1) ? num_sents - 1 :
+                      k * (num_sents - 1) / (max_probe_lengths - 1);
+        while(num_seen <= rank){
+            ++it;
+            num_seen += it->second;
+        }
+        if(probe_lengths.empty() || probe_lengths.back() != it->first){
+            probe_lengths.push_back(it->first);
+        }
+    }
+}
+
+void MemoryCalibrator::read_graph_pools(MemoryCalibrator::BUCKET_PROBE_t* pt_probe)
+{
+    pt_probe->fxs_bytes = pool_used(dynet::DeviceMempool::FXS);
+    pt_probe->dedfs_bytes = pool_used(dynet::DeviceMempool::DEDFS);
+}
+
+size_t MemoryCalibrator::read_param_pool()
+{
+    return pool_used(dynet::DeviceMempool::PS);
+}
+
+double MemoryCalibrator::get_graph_budget(const size_t& memory_budget_mb, const size_t& ps_bytes)
+{
+    double graph_budget = (static_cast<double>(memory_budget_mb) - SCRATCH_POOL_MB) *
+                          BYTES_PER_MB / POOL_HEADROOM - static_cast<double>(ps_bytes);
+    if(graph_budget <= 0){
+        std::cout << "Memory budget of " << memory_budget_mb << " MB is too small for the params: "
+                  << ps_bytes / BYTES_PER_MB << " MB" << std::endl;
+        abort();
+    }
+    return graph_budget;
+}
+
+void MemoryCalibrator::choose_batch_sizes(MemoryCalibrator::CALIBRATION_RESULT_t* pt_result,
+                                          const std::map<unsigned int, std::vector<MemoryCalibrator::BUCKET_PROBE_t> >& fitting_probes,
+                                          const std::map<unsigned int, unsigned int>& length_counts,
+                                          const double& graph_budget)
+{
+    typedef std::map<unsigned int, std::vector<MemoryCalibrator::BUCKET_PROBE_t> > PROBES_FOR_LENGTH_t;
+
+    // The FXS and DEDFS pools must each hold their largest graph, and these
+    // can come from different lengths. While the two peaks do not fit in the
+    // budget together, shrink the batch of the length with the largest graph.
+    std::map<unsigned int, size_t> chosen_idx;
+    for(PROBES_FOR_LENGTH_t::const_iterator it=fitting_probes.begin(); it!=fitting_probes.end(); ++it){
+        chosen_idx[it->first] = pick_fastest(it->second, static_cast<size_t>(graph_budget));
+    }
+    while(true){
+        pt_result->fxs_bytes = 0;
+        pt_result->dedfs_bytes = 0;
+        PROBES_FOR_LENGTH_t::const_iterator largest = fitting_probes.begin();
+        for(PROBES_FOR_LENGTH_t::const_iterator it=fitting_probes.begin(); it!=fitting_probes.end(); ++it){
+            const MemoryCalibrator::BUCKET_PROBE_t& chosen = it->second[chosen_idx[it->first]];
+            pt_result->fxs_bytes = std::max(pt_result->fxs_bytes, chosen.fxs_bytes);
+            pt_result->dedfs_bytes = std::max(pt_result->dedfs_bytes, chosen.dedfs_bytes);
+            if(graph_bytes(chosen) > graph_bytes(largest->second[chosen_idx[largest->first]])){
+                largest = it;
+            }
+        }
+
+        if(pt_result->fxs_bytes + pt_result->dedfs_bytes <= graph_budget){
+            break;
+        }
+
+        size_t& idx = chosen_idx[largest->first];
+        if(idx == 0){
+            std::cout << "WARNING: pools for the calibrated batches exceed the memory budget" << std::endl;
+            break;
+        }
+        idx = pick_fastest(largest->second, graph_bytes(largest->second[idx]) - 1);
+    }
+
+    std::map<unsigned int, unsigned int> batch_size_for_probe_length;
+    pt_result->probes.clear();
+    for(PROBES_FOR_LENGTH_t::const_iterator it=fitting_probes.begin(); it!=fitting_probes.end(); ++it){
+        pt_result->probes[it->first] = it->second[chosen_idx[it->first]];
+        batch_size_for_probe_length[it->first] = pt_result->probes[it->first].batch_size;
+    }
+
+    // Lengths that were not probed use the next longer probed length,
+    // graph memory grows with length so this stays within the budget
+    pt_result->batch_size_for_length.clear();
+    for(std::map<unsigned int, unsigned int>::const_iterator it=length_counts.begin();
+           it!=length_counts.end(); ++it){
+        pt_result->batch_size_for_length[it->first] =
+            PtbReader::get_batch_size_for_length(batch_size_for_probe_length, it->first);
+    }
+
+    // dynet 2 takes either a total or all four pools
+    pt_result->scs_bytes = SCRATCH_POOL_MB * BYTES_PER_MB;
+    std::ostringstream oss;
+    oss << to_pool_mb(pt_result->fxs_bytes) << ","
+        << to_pool_mb(pt_result->dedfs_bytes) << ","
+        << to_pool_mb(pt_result->ps_bytes) << ","
+        << SCRATCH_POOL_MB;
+    pt_result->mem_descriptor = oss.str();
+}
+
+void MemoryCalibrator::log_calibration(const MemoryCalibrator::CALIBRATION_RESULT_t& result)
+{
+    std::cout << "logging calibration" << std::endl;
+
+    for(std::map<unsigned int, MemoryCalibrator::BUCKET_PROBE_t>::const_iterator it=result.probes.begin();
+           it!=result.probes.end(); ++it){
+        std::cout << "size = " << it->first
+                  << " batch_size = " << it->second.batch_size
+                  << " graph MB = " << (it->second.fxs_bytes + it->second.dedfs_bytes) / BYTES_PER_MB
+                  << " tokens/sec = " << it->second.tokens_per_sec
+                  << std::endl;
+    }
+
+    std::cout << "mem_descriptor (--dynet-mem) = " << result.mem_descriptor << std::endl;
+    std::cout << "Done logging calibration" << std::endl;
+}
+
+void MemoryCalibrator::save_calibration(const MemoryCalibrator::CALIBRATION_RESULT_t& result,
+                                        const std::string& file_path)
+{
+    std::ofstream ofs;
+    ofs.open(file_path, std::ofstream::out);
+
+    if(ofs.fail()){
+        std::cout << "Could not open file" << file_path << std::endl;
+        exit(1);
+    }
+
+    ofs << result.mem_descriptor << "\n";
+    for(std::map<unsigned int, unsigned int>::const_iterator it=result.batch_size_for_length.begin();
+           it!=result.batch_size_for_length.end(); ++it){
+        ofs << it->first << " " << it->second << "\n";
+    }
+
+    ofs.close();
+}
+
+bool MemoryCalibrator::load_calibration(MemoryCalibrator::CALIBRATION_RESULT_t* pt_result,
+                                        const std::string& file_path)
+{
+    std::ifstream ifs;
+    ifs.open(file_path, std::ifstream::in);
+
+    if(ifs.fail()){
+        return false;
+    }
+
+    pt_result->batch_size_for_length.clear();
+    unsigned int length = 0;
+    unsigned int batch_size = 0;
+    if(!std::getline(ifs, pt_result->mem_descriptor)){
+        std::cout << "Empty calibration file " << file_path << std::endl;
+        abort();
+    }
+    while(ifs >> length >> batch_size){
+        pt_result->batch_size_for_length[length] = batch_size;
+    }
+    if(!ifs.eof() || pt_result->batch_size_for_length.empty()){
+        std::cout << "Corrupt calibration file " << file_path << std::endl;
+        abort();
+    }
+
+    ifs.close();
+    return true;
+}
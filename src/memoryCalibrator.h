@@ -0,0 +1,214 @@
+#ifndef MEMORY_CALIBRATOR_H
+#define MEMORY_CALIBRATOR_H
+
+#include "ptbReader.h"
+#include "lmTrainer.h"
+
+#include "dynet/model.h"
+#include "dynet/training.h"
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <stddef.h>
+
+namespace MemoryCalibrator{
+
+typedef struct BucketProbe{
+    unsigned int batch_size;
+    size_t fxs_bytes;      // forward values
+    size_t dedfs_bytes;    // gradients
+    double tokens_per_sec; // forward + backward + update
+} BUCKET_PROBE_t;
+
+typedef struct CalibrationResult{
+    // sent length --> batch size, for PtbReader::create_batches
+    std::map<unsigned int, unsigned int> batch_size_for_length;
+
+    // probed length --> chosen probe
+    std::map<unsigned int, BUCKET_PROBE_t> probes;
+
+    // dynet pool sizes
+    size_t fxs_bytes;
+    size_t dedfs_bytes;
+    size_t ps_bytes;
+    size_t scs_bytes;
+
+    // value for --dynet-mem / DynetParams::mem_descriptor, "FXS,DEDFS,PS,SCS" in MB
+    std::string mem_descriptor;
+} CALIBRATION_RESULT_t;
+
+/*
+* Times the LmTrainer<Model, LossPolicy> training step on batches of real
+* sents for a set of lengths at quantiles of the length distribution of data,
+* and picks for each length the batch size with the best tokens/sec such that
+* the FXS + DEDFS + PS + SCS pools of mem_descriptor fit in memory_budget_mb.
+*
+* The model is updated while probing: pass a throwaway model with the same
+* type and dimensions as the one to be trained.
+*
+* dynet cannot resize its pools in-process (cleanup does not free them), so
+* the result is meant for the next run: see save_calibration.
+*/
+template<class Model, class LossPolicy>
+void calibrate(CALIBRATION_RESULT_t* pt_result,
+               Model* pt_model,
+               std::shared_ptr<dynet::ParameterCollection> sp_model,
+               const std::vector<std::vector<int> >& data,
+               const size_t& memory_budget_mb,
+               const unsigned int& max_batch_size,
+               const unsigned int& max_probe_lengths=16);
+
+void log_calibration(const CALIBRATION_RESULT_t& result);
+
+// mem_descriptor and batch_size_for_length, one line each
+void save_calibration(const CALIBRATION_RESULT_t& result, const std::string& file_path);
+
+// Reads a file written by save_calibration. Returns false if there is no such file.
+bool load_calibration(CALIBRATION_RESULT_t* pt_result, const std::string& file_path);
+
+// Helpers of calibrate that do not depend on the model
+
+// Lengths to probe, at evenly spaced quantiles of the sent count.
+// The longest length is always probed.
+void get_probe_lengths(std::vector<unsigned int>* pt_probe_lengths,
+                       const std::map<unsigned int, unsigned int>& length_counts,
+                       const unsigned int& max_probe_lengths);
+
+// Bytes used in the FXS and DEDFS pools by the last graph
+void read_graph_pools(BUCKET_PROBE_t* pt_probe);
+
+// Bytes used in the PS pool, i.e. params and trainer state
+size_t read_param_pool();
+
+// Bytes left for FXS + DEDFS once ps_bytes, the scratch pool and the pool
+// headroom are taken
+double get_graph_budget(const size_t& memory_budget_mb, const size_t& ps_bytes);
+
+// Picks a probe per probed length from the probes that fit in graph_budget,
+// in ascending batch size, and fills the rest of pt_result
+void choose_batch_sizes(CALIBRATION_RESULT_t* pt_result,
+                        const std::map<unsigned int, std::vector<BUCKET_PROBE_t> >& fitting_probes,
+                        const std::map<unsigned int, unsigned int>& length_counts,
+                        const double& graph_budget);
+
+template<class Model, class LossPolicy>
+double probe_step(BUCKET_PROBE_t* pt_probe,
+                  LmTrainer<Model, LossPolicy>* pt_lm_trainer,
+                  dynet::Trainer* pt_trainer,
+                  const std::vector<const std::vector<int>*>& batch)
+{
+    /*
+    * One training step on the batch, timed.
+    * dynet frees FXS at the first forward of a graph and DEDFS at the
+    * start of backward, so the bytes read after the step are the peak
+    * of this graph only.
+    */
+
+    typename LmTrainer<Model, LossPolicy>::BATCH_LOSS_t batch_loss;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pt_lm_trainer->run_batch(&batch_loss, batch, pt_trainer);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    read_graph_pools(pt_probe);
+    return elapsed.count();
+}
+
+template<class Model, class LossPolicy>
+void calibrate(CALIBRATION_RESULT_t* pt_result,
+               Model* pt_model,
+               std::shared_ptr<dynet::ParameterCollection> sp_model,
+               const std::vector<std::vector<int> >& data,
+               const size_t& memory_budget_mb,
+               const unsigned int& max_batch_size,
+               const unsigned int& max_probe_lengths)
+{
+    const unsigned int NUM_TRIALS = 2; // step time = min over trials
+
+    if(data.empty()){
+        std::cout << "Cannot calibrate on empty data" << std::endl;
+        abort();
+    }
+
+    if(max_batch_size == 0 || max_probe_lengths == 0){
+        std::cout << "max_batch_size and max_probe_lengths cannot be zero" << std::endl;
+        abort();
+    }
+
+    // sent length --> sents of that length
+    std::map<unsigned int, std::vector<const std::vector<int>*> > sents_for_length;
+    for(size_t i=0; i<data.size(); ++i){
+        if(data[i].size() >= 2){
+            sents_for_length[data[i].size()].push_back(&data[i]);
+        }
+    }
+
+    std::map<unsigned int, unsigned int> length_counts;
+    PtbReader::get_length_counts(&length_counts, data);
+    length_counts.erase(length_counts.begin(), length_counts.lower_bound(2));
+    if(length_counts.empty()){
+        std::cout << "Cannot calibrate without sents of length >= 2" << std::endl;
+        abort();
+    }
+    std::vector<unsigned int> probe_lengths;
+    get_probe_lengths(&probe_lengths, length_counts, max_probe_lengths);
+
+    LmTrainer<Model, LossPolicy> lmTrainer(pt_model, sp_model);
+    dynet::AdamTrainer trainer(*sp_model);
+    std::vector<const std::vector<int>*> batch;
+    BUCKET_PROBE_t probe;
+
+    // Warm up, this also allocates the trainer state in the PS pool
+    batch.push_back(sents_for_length[probe_lengths.front()].front());
+    probe_step(&probe, &lmTrainer, &trainer, batch);
+    pt_result->ps_bytes = read_param_pool();
+    double graph_budget = get_graph_budget(memory_budget_mb, pt_result->ps_bytes);
+
+    // Probe batch sizes 1, 2, 4, ..., max_batch_size for each length
+    // probed length --> probes that fit in the budget, in ascending batch size
+    std::map<unsigned int, std::vector<BUCKET_PROBE_t> > fitting_probes;
+    for(size_t i=0; i<probe_lengths.size(); ++i){
+        unsigned int length = probe_lengths[i];
+        const std::vector<const std::vector<int>*>& sents = sents_for_length[length];
+        std::vector<BUCKET_PROBE_t>& fitting = fitting_probes[length];
+
+        for(unsigned int batch_size=1; ; batch_size*=2){
+            batch_size = std::min(batch_size, max_batch_size);
+            batch.clear();
+            for(unsigned int j=0; j<batch_size; ++j){
+                batch.push_back(sents[j % sents.size()]);
+            }
+
+            double step_time = 0.0;
+            for(unsigned int trial=0; trial<NUM_TRIALS; ++trial){
+                double t = probe_step(&probe, &lmTrainer, &trainer, batch);
+                step_time = (trial == 0) ? t : std::min(step_time, t);
+            }
+            probe.batch_size = batch_size;
+            probe.tokens_per_sec = batch_size * length / step_time;
+
+            if(probe.fxs_bytes + probe.dedfs_bytes > graph_budget){
+                if(fitting.empty()){
+                    std::cout << "WARNING: batch of one sent of length " << length
+                              << " does not fit in the memory budget" << std::endl;
+                    fitting.push_back(probe);
+                }
+                break;
+            }
+            fitting.push_back(probe);
+
+            if(batch_size == max_batch_size){
+                break;
+            }
+        }
+    }
+
+    choose_batch_sizes(pt_result, fitting_probes, length_counts, graph_budget);
+}
+
+} // MemoryCalibrator
+
+#endif
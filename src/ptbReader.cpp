@@ -8,12 +8,230 @@
 #include <iostream>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <map>
 #include <algorithm>
 #include <utility>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <atomic>
 
 namespace{
 
+typedef struct Shard{
+    // byte range [begin, end) of the file, on line boundaries
+    std::string file_path;
+    unsigned int file_idx;
+    unsigned long begin;
+    unsigned long end;
+
+    // thread local vocab
+    std::unordered_map<std::string, int> local_ids;
+    std::vector<std::string> local_words;
+    std::vector<unsigned long> local_counts;
+
+    // sents in local ids, then in dict ids after remapping
+    std::vector<std::vector<int> > sents;
+} SHARD_t;
+
+void run_parallel(const size_t& num_tasks,
+                  const unsigned int& num_threads,
+                  const std::function<void(size_t)>& task)
+{
+    // Each thread takes the next task until none are left
+    std::atomic<size_t> next_task(0);
+    std::vector<std::thread> threads;
+    for(unsigned int i=0; i<num_threads && i<num_tasks; ++i){
+        threads.push_back(std::thread([&](){
+            for(size_t t=next_task++; t<num_tasks; t=next_task++){
+                task(t);
+            }
+        }));
+    }
+    for(size_t i=0; i<threads.size(); ++i){
+        threads[i].join();
+    }
+}
+
+void split_file_into_shards(std::vector<SHARD_t>* pt_shards,
+                            const std::string& file_path,
+                            const unsigned int& file_idx,
+                            const unsigned int& num_shards)
+{
+    std::ifstream ifs;
+    ifs.open(file_path, std::ifstream::in | std::ifstream::binary);
+    if(ifs.fail()){
+        std::cout << "Could not open file" << file_path << std::endl;
+        exit(1);
+    }
+
+    ifs.seekg(0, std::ifstream::end);
+    unsigned long file_size = static_cast<unsigned long>(ifs.tellg());
+
+    // Move each nominal boundary to the start of the next line
+    std::vector<unsigned long> boundaries(1, 0);
+    std::string line;
+    for(unsigned int k=1; k<num_shards; ++k){
+        unsigned long boundary = file_size * k / num_shards;
+        if(boundary == 0){
+            boundaries.push_back(0);
+            continue;
+        }
+        ifs.clear();
+        ifs.seekg(boundary - 1);
+        if(std::getline(ifs, line) && ifs.tellg() >= 0){
+            boundary = static_cast<unsigned long>(ifs.tellg());
+        }else{
+            boundary = file_size;
+        }
+        boundaries.push_back(std::max(boundary, boundaries.back()));
+    }
+    boundaries.push_back(file_size);
+    ifs.close();
+
+    for(unsigned int k=0; k<num_shards; ++k){
+        if(boundaries[k] == boundaries[k + 1]){
+            continue;
+        }
+        pt_shards->push_back(SHARD_t());
+        SHARD_t& shard = pt_shards->back();
+        shard.file_path = file_path;
+        shard.file_idx = file_idx;
+        shard.begin = boundaries[k];
+        shard.end = boundaries[k + 1];
+    }
+}
+
+int get_local_id(SHARD_t* pt_shard, const std::string& word)
+{
+    std::unordered_map<std::string, int>::const_iterator it = pt_shard->local_ids.find(word);
+    if(it != pt_shard->local_ids.end()){
+        ++pt_shard->local_counts[it->second];
+        return it->second;
+    }
+    int local_id = pt_shard->local_words.size();
+    pt_shard->local_ids[word] = local_id;
+    pt_shard->local_words.push_back(word);
+    pt_shard->local_counts.push_back(1);
+    return local_id;
+}
+
+void tokenize_shard(SHARD_t* pt_shard,
+                    const std::string& bos,
+                    const std::string& eos)
+{
+    /*
+    * Same as get_ptb_data: each line is split on whitespace and
+    * surrounded by bos and eos.
+    */
+
+    SHARD_t& shard = *pt_shard;
+    std::ifstream ifs;
+    ifs.open(shard.file_path, std::ifstream::in | std::ifstream::binary);
+    if(ifs.fail()){
+        std::cout << "Could not open file" << shard.file_path << std::endl;
+        exit(1);
+    }
+    ifs.seekg(shard.begin);
+
+    int bos_id = get_local_id(&shard, bos);
+    int eos_id = get_local_id(&shard, eos);
+    --shard.local_counts[bos_id];
+    --shard.local_counts[eos_id];
+
+    std::string line;
+    std::string word;
+    unsigned long pos = shard.begin;
+    while(pos < shard.end && std::getline(ifs, line)){
+        pos += line.size() + 1;
+
+        std::vector<int> sent_ids;
+        sent_ids.push_back(bos_id);
+        ++shard.local_counts[bos_id];
+        size_t i = 0;
+        while(i < line.size()){
+            while(i < line.size() && isspace(static_cast<unsigned char>(line[i]))){
+                ++i;
+            }
+            size_t word_begin = i;
+            while(i < line.size() && !isspace(static_cast<unsigned char>(line[i]))){
+                ++i;
+            }
+            if(i > word_begin){
+                word.assign(line, word_begin, i - word_begin);
+                sent_ids.push_back(get_local_id(&shard, word));
+            }
+        }
+        sent_ids.push_back(eos_id);
+        ++shard.local_counts[eos_id];
+        shard.sents.push_back(sent_ids);
+    }
+
+    ifs.close();
+}
+
+bool comparator_to_sort_in_descending_frequency(const std::pair<std::string, unsigned long>& lhs,
+                                                const std::pair<std::string, unsigned long>& rhs)
+{
+    // Ties are broken by the word so that the order does not depend on the sharding
+    if(lhs.second != rhs.second){
+        return (lhs.second > rhs.second);
+    }
+    return (lhs.first < rhs.first);
+}
+
+void build_vocab_by_frequency(std::vector<std::string>* pt_vocab,
+                              const std::unordered_map<std::string, unsigned long>& word_counts,
+                              const unsigned int& min_count,
+                              const unsigned int& max_vocab_size,
+                              const std::vector<std::string>& special_words,
+                              const std::string& unk)
+{
+    /*
+    * Words are sorted in descending frequency and cut by min_count and
+    * max_vocab_size. special_words are always kept. unk counts as often as
+    * the words it replaces.
+    */
+
+    std::vector<std::pair<std::string, unsigned long> > sorted_words;
+    std::map<std::string, unsigned long> special_counts;
+    for(size_t i=0; i<special_words.size(); ++i){
+        special_counts[special_words[i]] = 0;
+    }
+    for(std::unordered_map<std::string, unsigned long>::const_iterator it=word_counts.begin();
+           it!=word_counts.end(); ++it){
+        if(special_counts.find(it->first) != special_counts.end()){
+            special_counts[it->first] = it->second;
+        }else{
+            sorted_words.push_back(*it);
+        }
+    }
+    std::sort(sorted_words.begin(), sorted_words.end(), comparator_to_sort_in_descending_frequency);
+
+    size_t num_kept = 0;
+    size_t max_kept = sorted_words.size();
+    if(max_vocab_size > 0){
+        max_kept = (max_vocab_size > special_counts.size()) ? max_vocab_size - special_counts.size() : 0;
+    }
+    while(num_kept < sorted_words.size() && num_kept < max_kept &&
+              sorted_words[num_kept].second >= min_count){
+        ++num_kept;
+    }
+    for(size_t i=num_kept; i<sorted_words.size(); ++i){
+        special_counts[unk] += sorted_words[i].second;
+    }
+    sorted_words.resize(num_kept);
+
+    sorted_words.insert(sorted_words.end(), special_counts.begin(), special_counts.end());
+    std::sort(sorted_words.begin(), sorted_words.end(), comparator_to_sort_in_descending_frequency);
+
+    pt_vocab->clear();
+    for(size_t i=0; i<sorted_words.size(); ++i){
+        pt_vocab->push_back(sorted_words[i].first);
+    }
+}
+
 bool comparator_to_sort_in_ascending_length(const std::vector<int>& lhs, const std::vector<int>& rhs)
 {
     return (lhs.size() < rhs.size());
@@ -21,7 +239,7 @@ bool comparator_to_sort_in_ascending_length(const std::vector<int>& lhs, const s
 
 void test_create_batches(const std::vector<PtbReader::BATCH_INDEX_t>& batchIndexList,
                         const std::vector<std::vector<int> >& data, 
-                        const unsigned int& max_batch_size)
+                        const std::map<unsigned int, unsigned int>& max_batch_size_for_length)
 {
     // test batches have equal length
     bool has_batching_error = false;
@@ -33,7 +251,12 @@ void test_create_batches(const std::vector<PtbReader::BATCH_INDEX_t>& batchIndex
                 has_batching_error = true;
                 std::cout << "ERROR: length of data in batch does not match" << std::endl;
             }
-        } 
+        }
+        if(current_batch_index.batch_num_elements >
+               PtbReader::get_batch_size_for_length(max_batch_size_for_length, batch_for_length)){
+            has_batching_error = true;
+            std::cout << "ERROR: batch is larger than the max batch size for its length" << std::endl;
+        }
     }
     
     if(!has_batching_error){
@@ -100,6 +323,142 @@ void PtbReader::get_ptb_data(std::vector<std::vector<int> >* pt_ptb_data,
     return;
 }
 
+void PtbReader::get_ptb_data_parallel(const std::vector<std::vector<std::vector<int> >* >& pt_datasets,
+                                      dynet::Dict* pt_dict,
+                                      const std::vector<std::string>& file_paths,
+                                      unsigned int num_threads,
+                                      const unsigned int& min_count,
+                                      const unsigned int& max_vocab_size,
+                                      const std::string& unk,
+                                      const std::string& bos,
+                                      const std::string& eos)
+{
+    if(file_paths.empty() || file_paths.size() != pt_datasets.size()){
+        std::cout << "Need one dataset per file and at least one file" << std::endl;
+        abort();
+    }
+
+    if(pt_dict->size() != 0){
+        std::cout << "dict must be empty" << std::endl;
+        abort();
+    }
+
+    if(num_threads == 0){
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // Shard all the files so that they are tokenized concurrently
+    std::vector<SHARD_t> shards;
+    for(unsigned int i=0; i<file_paths.size(); ++i){
+        split_file_into_shards(&shards, file_paths[i], i, num_threads);
+    }
+    run_parallel(shards.size(), num_threads, [&](size_t k){
+        tokenize_shard(&shards[k], bos, eos);
+    });
+
+    // Merge the counts of the first file and build the dict
+    std::unordered_map<std::string, unsigned long> word_counts;
+    for(size_t k=0; k<shards.size(); ++k){
+        if(shards[k].file_idx != 0){
+            continue;
+        }
+        for(size_t i=0; i<shards[k].local_words.size(); ++i){
+            word_counts[shards[k].local_words[i]] += shards[k].local_counts[i];
+        }
+    }
+
+    std::vector<std::string> special_words;
+    special_words.push_back(bos);
+    special_words.push_back(eos);
+    special_words.push_back(unk);
+    std::vector<std::string> vocab;
+    build_vocab_by_frequency(&vocab, word_counts, min_count, max_vocab_size, special_words, unk);
+
+    std::unordered_map<std::string, int> word_ids;
+    for(size_t i=0; i<vocab.size(); ++i){
+        word_ids[vocab[i]] = pt_dict->convert(vocab[i]);
+    }
+    pt_dict->freeze();
+    pt_dict->set_unk(unk);
+    int unk_id = word_ids[unk];
+
+    // Remap local ids to dict ids
+    run_parallel(shards.size(), num_threads, [&](size_t k){
+        SHARD_t& shard = shards[k];
+        std::vector<int> local_to_dict(shard.local_words.size(), unk_id);
+        for(size_t i=0; i<shard.local_words.size(); ++i){
+            std::unordered_map<std::string, int>::const_iterator it = word_ids.find(shard.local_words[i]);
+            if(it != word_ids.end()){
+                local_to_dict[i] = it->second;
+            }
+        }
+        for(size_t i=0; i<shard.sents.size(); ++i){
+            for(size_t j=0; j<shard.sents[i].size(); ++j){
+                shard.sents[i][j] = local_to_dict[shard.sents[i][j]];
+            }
+        }
+    });
+
+    // Shards are in file order
+    for(size_t k=0; k<shards.size(); ++k){
+        std::vector<std::vector<int> >& data = *pt_datasets[shards[k].file_idx];
+        for(size_t i=0; i<shards[k].sents.size(); ++i){
+            data.push_back(std::vector<int>());
+            data.back().swap(shards[k].sents[i]);
+        }
+    }
+}
+
+void PtbReader::save_dict(const dynet::Dict& dict, const std::string& file_path)
+{
+    std::ofstream ofs;
+    ofs.open(file_path, std::ofstream::out);
+    
+    if(ofs.fail()){
+        std::cout << "Could not open file" << file_path << std::endl;
+        exit(1);
+    }
+
+    for(unsigned int i=0; i<dict.size(); ++i){
+        ofs << dict.convert(i) << "\n";
+    }
+
+    ofs.close();
+}
+
+void PtbReader::load_dict(dynet::Dict* pt_dict,
+                          const std::string& file_path,
+                          const std::string& unk)
+{
+    std::ifstream ifs;
+    ifs.open(file_path, std::ifstream::in);
+    
+    if(ifs.fail()){
+        std::cout << "Could not open file" << file_path << std::endl;
+        exit(1);
+    }
+
+    std::string word;
+    bool has_unk = false;
+    while(std::getline(ifs, word)){
+        pt_dict->convert(word);
+        has_unk = has_unk || (word == unk);
+    }
+    ifs.close();
+
+    if(!has_unk){
+        std::cout << "unk " << unk << " is not in the dict file " << file_path << std::endl;
+        abort();
+    }
+    pt_dict->freeze();
+    pt_dict->set_unk(unk);
+}
+
+std::string PtbReader::get_checkpoint_dict_file(const std::string& checkpoint_file)
+{
+    return checkpoint_file + ".dict";
+}
+
 void PtbReader::log_data_stats(const std::vector<std::vector<int> >& ptb_data, 
                                const dynet::Dict& dict,
                                const std::string& data_type)
@@ -115,16 +474,10 @@ void PtbReader::log_data_stats(const std::vector<std::vector<int> >& ptb_data,
     std::cout << "dict.size() = " << dict.size() << std::endl;
     std::cout << "ptb_train_data.size() = " << ptb_data.size() << std::endl;
 
-    std::map<unsigned int, int> size_count;
-    for(size_t i=0; i<ptb_data.size(); ++i){
-        if(size_count.find(ptb_data[i].size()) == size_count.end()){
-            size_count[ptb_data[i].size()] = 1;
-        }else{
-            size_count[ptb_data[i].size()] += 1;
-        }
-    }
+    std::map<unsigned int, unsigned int> size_count;
+    PtbReader::get_length_counts(&size_count, ptb_data);
 
-    for(std::map<unsigned int, int>::const_iterator it=size_count.begin();
+    for(std::map<unsigned int, unsigned int>::const_iterator it=size_count.begin();
            it!=size_count.end(); ++it){
         std::cout << "size = " << it->first
                   << " count = " << it->second
@@ -134,6 +487,19 @@ void PtbReader::log_data_stats(const std::vector<std::vector<int> >& ptb_data,
     std::cout << "Done logging for data_type = " << data_type << std::endl;
 }
 
+void PtbReader::get_length_counts(std::map<unsigned int, unsigned int>* pt_length_counts,
+                                  const std::vector<std::vector<int> >& data)
+{
+    std::map<unsigned int, unsigned int>& length_counts = *pt_length_counts;
+    for(size_t i=0; i<data.size(); ++i){
+        if(length_counts.find(data[i].size()) == length_counts.end()){
+            length_counts[data[i].size()] = 1;
+        }else{
+            length_counts[data[i].size()] += 1;
+        }
+    }
+}
+
 void PtbReader::sort_data_in_ascending_length(std::vector<std::vector<int> >* pt_data)
 {
     /*
@@ -149,6 +515,18 @@ void PtbReader::sort_data_in_ascending_length(std::vector<std::vector<int> >* pt
 void PtbReader::create_batches(std::vector<PtbReader::BATCH_INDEX_t>* pt_batchIndexList,
                                const std::vector<std::vector<int> >& data, 
                                const unsigned int& max_batch_size) 
+{
+    // Same max_batch_size for every length in data
+    std::map<unsigned int, unsigned int> max_batch_size_for_length;
+    for(unsigned int i=0; i<data.size(); ++i){
+        max_batch_size_for_length[data[i].size()] = max_batch_size;
+    }
+    PtbReader::create_batches(pt_batchIndexList, data, max_batch_size_for_length);
+}
+
+void PtbReader::create_batches(std::vector<PtbReader::BATCH_INDEX_t>* pt_batchIndexList,
+                               const std::vector<std::vector<int> >& data, 
+                               const std::map<unsigned int, unsigned int>& max_batch_size_for_length) 
 {
     /* Creates batches where all elements in the batch have the same length
     *
@@ -161,7 +539,7 @@ void PtbReader::create_batches(std::vector<PtbReader::BATCH_INDEX_t>* pt_batchIn
                <31, 2>,        <5, 32>,    <37, 1>, <23, 87>, <5, 65>,
                <2, 4, 43>,     <18, 45, 6>,
                <34, 45, 65, 76> >
-    * max_batch_size = 3
+    * max_batch_size_for_length = {1: 3, 2: 3, 3: 3, 4: 3}
     * batchIndexList: <(0, 3), (3, 1), (4, 3), (7, 2), (9, 2), (11, 1)>
     */  
     
@@ -170,10 +548,18 @@ void PtbReader::create_batches(std::vector<PtbReader::BATCH_INDEX_t>* pt_batchIn
         abort();
     }
  
-    if(max_batch_size == 0){
-       std::cout << "max_batch_size cannot be zero" << std::endl;
+    if(max_batch_size_for_length.empty()){
+       std::cout << "max_batch_size_for_length cannot be empty" << std::endl;
        abort();
     }
+
+    for(std::map<unsigned int, unsigned int>::const_iterator it=max_batch_size_for_length.begin();
+           it!=max_batch_size_for_length.end(); ++it){
+        if(it->second == 0){
+            std::cout << "max_batch_size cannot be zero" << std::endl;
+            abort();
+        }
+    }
   
     PtbReader::BATCH_INDEX_t batch_index; 
     batch_index.batch_begin_idx = 0;
@@ -182,6 +568,8 @@ void PtbReader::create_batches(std::vector<PtbReader::BATCH_INDEX_t>* pt_batchIn
  
     unsigned int current_batch_size = 1;
     unsigned int batch_for_length = data[0].size();
+    unsigned int max_batch_size = PtbReader::get_batch_size_for_length(max_batch_size_for_length,
+                                                                       batch_for_length);
     for(unsigned int i=1; i<data.size(); ++i){
         if(current_batch_size==max_batch_size || data[i].size()!=batch_for_length){
             pt_batchIndexList->back().batch_num_elements = current_batch_size;
@@ -192,10 +580,22 @@ void PtbReader::create_batches(std::vector<PtbReader::BATCH_INDEX_t>* pt_batchIn
  
             current_batch_size = 1;
             batch_for_length = data[i].size();
+            max_batch_size = PtbReader::get_batch_size_for_length(max_batch_size_for_length,
+                                                                  batch_for_length);
         }else{
             ++current_batch_size;
         }
     }
 
-    test_create_batches(*pt_batchIndexList, data, max_batch_size);
+    test_create_batches(*pt_batchIndexList, data, max_batch_size_for_length);
+}
+
+unsigned int PtbReader::get_batch_size_for_length(const std::map<unsigned int, unsigned int>& max_batch_size_for_length,
+                                                  const unsigned int& length)
+{
+    std::map<unsigned int, unsigned int>::const_iterator it = max_batch_size_for_length.lower_bound(length);
+    if(it == max_batch_size_for_length.end()){
+        return max_batch_size_for_length.rbegin()->second;
+    }
+    return it->second;
 }
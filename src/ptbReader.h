@@ -4,6 +4,7 @@
 #include <vector>
 #include "dynet/dict.h"
 #include <string>
+#include <map>
 
 namespace PtbReader{
 
@@ -18,15 +19,63 @@ void get_ptb_data(std::vector<std::vector<int> >* pt_ptb_data,
                   const std::string& bos="<bos>",
                   const std::string& eos="<eos>");
 
+/*
+* Reads file_paths in parallel into pt_datasets (one dataset per file).
+* Each file is split into num_threads shards on line boundaries. The shards
+* are tokenized and counted with thread local vocabs, the vocab is built from
+* the counts of file_paths[0] only, and the ids are remapped in parallel.
+*
+* pt_dict must be empty. It is filled in descending order of frequency with
+* words occurring at least min_count times, keeping at most max_vocab_size
+* words (0 for no limit) including bos, eos and unk, then frozen with unk set.
+* num_threads = 0 uses the number of hardware threads.
+*/
+void get_ptb_data_parallel(const std::vector<std::vector<std::vector<int> >* >& pt_datasets,
+                           dynet::Dict* pt_dict,
+                           const std::vector<std::string>& file_paths,
+                           unsigned int num_threads=0,
+                           const unsigned int& min_count=1,
+                           const unsigned int& max_vocab_size=0,
+                           const std::string& unk="<unk>",
+                           const std::string& bos="<bos>",
+                           const std::string& eos="<eos>");
+
+// One word per line, in id order
+void save_dict(const dynet::Dict& dict, const std::string& file_path);
+
+// Reads a dict written by save_dict. The dict is frozen with unk set.
+// Aborts if unk is not in the file, since set_unk would append it.
+void load_dict(dynet::Dict* pt_dict,
+               const std::string& file_path,
+               const std::string& unk="<unk>");
+
+// File next to a model checkpoint that holds the dict of its word ids
+std::string get_checkpoint_dict_file(const std::string& checkpoint_file);
+
 void log_data_stats(const std::vector<std::vector<int> >& ptb_data, 
                     const dynet::Dict& dict, 
                     const std::string& data_type="");
 
+// sent length --> number of sents with that length
+void get_length_counts(std::map<unsigned int, unsigned int>* pt_length_counts,
+                       const std::vector<std::vector<int> >& data);
+
 void sort_data_in_ascending_length(std::vector<std::vector<int> >* pt_data);
 
 void create_batches(std::vector<BATCH_INDEX_t>* pt_batchIndexList,
                     const std::vector<std::vector<int> >& data, 
                     const unsigned int& max_batch_size);
+
+// Same as above with a max batch size per sent length.
+// See get_batch_size_for_length for lengths missing from the map.
+void create_batches(std::vector<BATCH_INDEX_t>* pt_batchIndexList,
+                    const std::vector<std::vector<int> >& data, 
+                    const std::map<unsigned int, unsigned int>& max_batch_size_for_length);
+
+// Batch size of the shortest length in the map that is >= length, or of
+// the longest length in the map if there is none
+unsigned int get_batch_size_for_length(const std::map<unsigned int, unsigned int>& max_batch_size_for_length,
+                                       const unsigned int& length);
  
 
 } // PtbReader
@@ -1,4 +1,5 @@
 #include "rnnLm.h"
+#include "lmTrainer.h"
 
 #include "dynet/io.h"
 #include "dynet/expr.h"
@@ -61,3 +62,14 @@ void RnnLm::forward(std::shared_ptr<dynet::ComputationGraph> sp_cg,
     *sp_error = dynet::sum(errors);    
     return;
 }
+
+void RnnLm::train(std::vector<std::vector<int> >* pt_train_data,
+                  std::vector<std::vector<int> >* pt_valid_data,
+                  const unsigned int& max_epochs,
+                  const std::map<unsigned int, unsigned int>& batch_size_for_length,
+                  const std::string& checkpoint_file,
+                  const dynet::Dict* pt_dict)
+{
+    LmTrainer<RnnLm, NoKlLoss> trainer(this, d_sp_model, checkpoint_file, pt_dict);
+    trainer.train(pt_train_data, pt_valid_data, max_epochs, batch_size_for_length);
+}
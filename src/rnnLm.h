@@ -8,6 +8,8 @@
 #include "dynet/gru.h"
 #include "dynet/dict.h"
 
+#include <map>
+
 class RnnLm{
 
 public:
@@ -24,6 +26,14 @@ void forward(std::shared_ptr<dynet::ComputationGraph> sp_cg,
              std::shared_ptr<dynet::Expression> sp_error,
              const std::vector<int>& sent);
 
+// Max batch size per sent length, e.g. from MemoryCalibrator::calibrate
+void train(std::vector<std::vector<int> >* pt_train_data,
+           std::vector<std::vector<int> >* pt_valid_data,
+           const unsigned int& max_epochs,
+           const std::map<unsigned int, unsigned int>& batch_size_for_length,
+           const std::string& checkpoint_file="",
+           const dynet::Dict* pt_dict=NULL);
+
 private:
 
 // dynet model
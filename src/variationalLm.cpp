@@ -1,5 +1,8 @@
 #include "variationalLm.h"
 #include "ptbReader.h"
+#include "frozenLmFormat.h"
+#include "frozenLm.h"
+#include "lmTrainer.h"
 
 #include "dynet/io.h"
 #include "dynet/expr.h"
@@ -11,6 +14,65 @@
 #include <iostream>
 #include <cassert>
 #include <algorithm>
+#include <fstream>
+#include <string.h>
+#include <math.h>
+
+namespace{
+
+std::vector<float> to_row_major(const std::vector<float>& col_major,
+                                unsigned int rows,
+                                unsigned int cols)
+{
+    std::vector<float> row_major(col_major.size());
+    for(unsigned int r=0; r<rows; ++r){
+        for(unsigned int c=0; c<cols; ++c){
+            row_major[r * cols + c] = col_major[c * rows + r];
+        }
+    }
+    return row_major;
+}
+
+void write_frozen_tensor(std::ofstream* pt_ofs,
+                         FrozenLmFormat::HEADER_t* pt_header,
+                         unsigned int tensor_id,
+                         const std::vector<float>& values)
+{
+    std::ofstream& ofs = *pt_ofs;
+    uint64_t offset = static_cast<uint64_t>(ofs.tellp());
+    uint64_t aligned_offset = FrozenLmFormat::align_offset(offset);
+    for(; offset<aligned_offset; ++offset){
+        ofs.put('\0');
+    }
+    pt_header->tensor_offsets[tensor_id] = aligned_offset;
+    ofs.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(float));
+}
+
+void check_equal_length(const std::vector<const std::vector<int>*>& sents)
+{
+    if(sents.empty() || sents[0]->size() < 2){
+        std::cout << "Cannot batch an empty batch or sents shorter than two words" << std::endl;
+        abort();
+    }
+    for(size_t b=1; b<sents.size(); ++b){
+        if(sents[b]->size() != sents[0]->size()){
+            std::cout << "ERROR: length of sents in batch does not match" << std::endl;
+            abort();
+        }
+    }
+}
+
+int find_word_id(const dynet::Dict& dict, const std::string& word)
+{
+    for(unsigned int i=0; i<dict.size(); ++i){
+        if(dict.convert(i) == word){
+            return i;
+        }
+    }
+    return -1;
+}
+
+}
 
 VariationalLm::VariationalLm(std::shared_ptr<dynet::ParameterCollection> sp_model,
                              unsigned int layers, 
@@ -137,6 +199,23 @@ void VariationalLm::encode(std::shared_ptr<dynet::ComputationGraph> sp_cg,
 
 }
 
+float VariationalLm::score(const std::vector<int>& sent, float* pt_enc_error)
+{
+    std::shared_ptr<dynet::ComputationGraph> sp_cg =
+                         std::make_shared<dynet::ComputationGraph>();
+    std::shared_ptr<dynet::Expression> sp_mu = std::make_shared<dynet::Expression>();
+    std::shared_ptr<dynet::Expression> sp_logvar = std::make_shared<dynet::Expression>();
+    std::shared_ptr<dynet::Expression> sp_enc_error = std::make_shared<dynet::Expression>();
+    std::shared_ptr<dynet::Expression> sp_dec_error = std::make_shared<dynet::Expression>();
+    this->encode(sp_cg, sp_mu, sp_logvar, sp_enc_error, sent);
+    this->decode(sp_cg, sp_mu, sp_dec_error, sent);
+    float dec_error = dynet::as_scalar(sp_cg->forward(*sp_dec_error));
+    if(pt_enc_error != NULL){
+        *pt_enc_error = dynet::as_scalar(sp_enc_error->value());
+    }
+    return dec_error;
+}
+
 void VariationalLm::reparameterize(std::shared_ptr<dynet::ComputationGraph> sp_cg,
                                    std::shared_ptr<dynet::Expression> sp_z,
                                    std::shared_ptr<dynet::Expression> sp_mu,
@@ -191,72 +270,271 @@ void VariationalLm::decode(std::shared_ptr<dynet::ComputationGraph> sp_cg,
     return;
 }
 
+void VariationalLm::encode_batch(std::shared_ptr<dynet::ComputationGraph> sp_cg,
+                                 std::shared_ptr<dynet::Expression> sp_mu,
+                                 std::shared_ptr<dynet::Expression> sp_logvar,
+                                 std::shared_ptr<dynet::Expression> sp_enc_error,
+                                 const std::vector<const std::vector<int>*>& sents)
+{
+    /*
+     * Same as encode, with one rnn pass over the whole batch.
+     * Word t of every sent is looked up together.
+    */
+
+    check_equal_length(sents);
+
+    d_source_rnn.new_graph(*sp_cg);
+    d_source_rnn.start_new_sequence();
+    std::vector<unsigned> word_ids(sents.size());
+    for(size_t t=0; t<sents[0]->size(); ++t){
+        for(size_t b=0; b<sents.size(); ++b){
+            word_ids[b] = (*sents[b])[t];
+        }
+        dynet::Expression word_exp = dynet::lookup(*sp_cg, d_p_lookup, word_ids);
+        d_source_rnn.add_input(word_exp);
+    }
+
+    // h-->h2
+    dynet::Expression e_W_hh2 = dynet::parameter(*sp_cg, d_p_W_hh2);
+    dynet::Expression e_b_h2 = dynet::parameter(*sp_cg, d_p_b_h2);
+    dynet::Expression e_h2 = dynet::tanh(e_W_hh2 * d_source_rnn.back() + e_b_h2);
+
+    // h2-->m
+    dynet::Expression e_W_h2m = dynet::parameter(*sp_cg, d_p_W_h2m);
+    dynet::Expression e_b_m = dynet::parameter(*sp_cg, d_p_b_m);
+    *sp_mu = dynet::affine_transform({e_b_m, e_W_h2m, e_h2});
+
+    // h2-->s
+    dynet::Expression e_W_h2s = dynet::parameter(*sp_cg, d_p_W_h2s);
+    dynet::Expression e_b_s = dynet::parameter(*sp_cg, d_p_b_s);
+    *sp_logvar = dynet::affine_transform({e_b_s, e_W_h2s, e_h2});
+
+    // KL Error, one value per sent
+    *sp_enc_error = 0.5 * dynet::sum_elems(dynet::exp(*sp_logvar) + dynet::square(*sp_mu) -1 - *sp_logvar);
+
+    return;
+}
+
+void VariationalLm::decode_batch(std::shared_ptr<dynet::ComputationGraph> sp_cg,
+                                 std::shared_ptr<dynet::Expression> sp_z,
+                                 std::shared_ptr<dynet::Expression> sp_dec_error,
+                                 const std::vector<const std::vector<int>*>& sents)
+{
+    check_equal_length(sents);
+
+    d_target_rnn.new_graph(*sp_cg);
+
+    // z-->h0
+    dynet::Expression e_W_zh0 = dynet::parameter(*sp_cg, d_p_W_zh0);
+    dynet::Expression e_b_h0 = dynet::parameter(*sp_cg, d_p_b_h0);
+    dynet::Expression e_h0 = dynet::affine_transform({e_b_h0, e_W_zh0, *sp_z});
+
+    std::vector<dynet::Expression> h0s;
+    h0s.push_back(e_h0); // multi layers not yet supported
+    d_target_rnn.start_new_sequence(h0s);
+
+    dynet::Expression e_W_hv = dynet::parameter(*sp_cg, d_p_W_hv);
+    dynet::Expression e_b_v = dynet::parameter(*sp_cg, d_p_b_v);
+    std::vector<unsigned> current_word_ids(sents.size());
+    std::vector<unsigned> next_word_ids(sents.size());
+    std::vector<dynet::Expression> errors;
+    for(size_t t=0; t<sents[0]->size()-1; ++t){
+        for(size_t b=0; b<sents.size(); ++b){
+            current_word_ids[b] = (*sents[b])[t];
+            next_word_ids[b] = (*sents[b])[t+1];
+        }
+
+        dynet::Expression x_t = dynet::lookup(*sp_cg, d_p_lookup, current_word_ids);
+        dynet::Expression h_t = d_target_rnn.add_input(x_t);
+
+        // h_t-->v
+        dynet::Expression e_v = dynet::affine_transform({e_b_v, e_W_hv, h_t});
+        errors.push_back(dynet::pickneglogsoftmax(e_v, next_word_ids));
+    }
+
+    // one value per sent
+    *sp_dec_error = dynet::sum(errors);
+    return;
+}
+
 void VariationalLm::train(std::vector<std::vector<int> >* pt_train_data,
                           std::vector<std::vector<int> >* pt_valid_data,
                           const unsigned int& max_epochs,
                           const unsigned int& batch_size)
+{
+    LmTrainer<VariationalLm, KlLoss> trainer(this, d_sp_model);
+    trainer.train(pt_train_data, pt_valid_data, max_epochs, batch_size);
+}
+
+void VariationalLm::train(std::vector<std::vector<int> >* pt_train_data,
+                          std::vector<std::vector<int> >* pt_valid_data,
+                          const unsigned int& max_epochs,
+                          const std::map<unsigned int, unsigned int>& batch_size_for_length,
+                          const std::string& checkpoint_file,
+                          const dynet::Dict* pt_dict)
 { 
- 
-    // Not doing explicit batching
-    // For explicit batching, look at code by duyvuleo/Transformer-DyNet
- 
-    // Prepare train data for batching
-    std::vector<std::vector<int> >& train_data = *pt_train_data;
-    PtbReader::sort_data_in_ascending_length(&train_data);
-    std::vector<PtbReader::BATCH_INDEX_t> batchIndexListTrain;
-    PtbReader::create_batches(&batchIndexListTrain, train_data, batch_size);
-
-    // Prepare valid data for batching
-    std::vector<std::vector<int> >& valid_data = *pt_valid_data;
-    PtbReader::sort_data_in_ascending_length(&valid_data);
-    std::vector<PtbReader::BATCH_INDEX_t> batchIndexListValid;
-    PtbReader::create_batches(&batchIndexListValid, valid_data, batch_size);
- 
-    dynet::AdamTrainer trainer(*d_sp_model);
-    std::shared_ptr<dynet::Expression> sp_enc_err = std::make_shared<dynet::Expression>();
-    std::shared_ptr<dynet::Expression> sp_dec_err = std::make_shared<dynet::Expression>();
-    for(unsigned int current_epoch=0; current_epoch<max_epochs; ++current_epoch){
-        unsigned int train_words = 0;
-        double train_loss = 0.0;
-        double dec_loss = 0.0;
-        unsigned int train_samples = 0;
-        std::random_shuffle(batchIndexListTrain.begin(), batchIndexListTrain.end());
-        for(unsigned int batch_id=0; batch_id<batchIndexListTrain.size();++batch_id){
-            
-            std::shared_ptr<dynet::ComputationGraph> sp_cg = 
-                                 std::make_shared<dynet::ComputationGraph>();
-            std::vector<dynet::Expression> tot_losses_expression;
-            std::vector<dynet::Expression> dec_losses_expression;
-            const PtbReader::BATCH_INDEX_t& batchIndex =  batchIndexListTrain[batch_id];
-            for(unsigned int sent_idx=batchIndex.batch_begin_idx; 
-                    sent_idx<batchIndex.batch_begin_idx + batchIndex.batch_num_elements; 
-                    ++sent_idx){
-                this->forward(sp_cg, sp_enc_err, sp_dec_err, train_data[sent_idx]);
-                tot_losses_expression.push_back((*sp_enc_err) + (*sp_dec_err));
-                dec_losses_expression.push_back(*sp_dec_err);
-                train_words += train_data[sent_idx].size();
-            }      
-            
-            // Calculate the loss and update trainer
-            dynet::Expression tot_loss_expression = dynet::sum(tot_losses_expression);
-            train_loss += dynet::as_scalar(sp_cg->forward(tot_loss_expression));
-            sp_cg->backward(tot_loss_expression);
-            trainer.update();
-           
-            // Calculate the dec loss
-            dynet::Expression dec_loss_expression = dynet::sum(dec_losses_expression);
-            //dec_loss += dynet::as_scalar(dec_loss_expression);
-            dec_loss += dynet::as_scalar(dec_loss_expression.value());
-   
-            train_samples += batchIndexListTrain[batch_id].batch_num_elements;
-
-            std::cout << " Total E = " << (train_loss / train_words )
-                      << " Decoder E = " << (dec_loss / train_words) 
-                      << " ppl = " << std::exp(dec_loss / train_words) 
-                      << " lines = " << train_samples
-                      << " current_epoch = " << current_epoch
+    LmTrainer<VariationalLm, KlLoss> trainer(this, d_sp_model, checkpoint_file, pt_dict);
+    trainer.train(pt_train_data, pt_valid_data, max_epochs, batch_size_for_length);
+}
+
+void VariationalLm::export_frozen(const std::string& file_path,
+                                  const dynet::Dict& dict,
+                                  const std::string& bos,
+                                  const std::string& eos,
+                                  const std::string& unk)
+{
+    /*
+    * See frozenLmFormat.h for the layout.
+    * The header is written twice: once to reserve its space and once more
+    * after all the offsets are known.
+    */
+
+    if(dict.size() != d_vocab_size){
+        std::cout << "dict size does not match the vocab size of the model" << std::endl;
+        abort();
+    }
+
+    std::ofstream ofs;
+    ofs.open(file_path, std::ofstream::out | std::ofstream::binary);
+    if(ofs.fail()){
+        std::cout << "Could not open file" << file_path << std::endl;
+        exit(1);
+    }
+
+    FrozenLmFormat::HEADER_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FrozenLmFormat::MAGIC, sizeof(header.magic));
+    header.version = FrozenLmFormat::VERSION;
+    header.input_dim = d_input_dim;
+    header.hidden_dim = d_hidden_dim;
+    header.hidden2_dim = d_hidden2_dim;
+    header.latent_dim = d_latent_dim;
+    header.vocab_size = d_vocab_size;
+    header.bos_id = find_word_id(dict, bos);
+    header.eos_id = find_word_id(dict, eos);
+    header.unk_id = find_word_id(dict, unk);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // vocab embed, one row per word
+    std::vector<float> lookup;
+    lookup.reserve(d_vocab_size * d_input_dim);
+    const std::vector<dynet::Tensor>& lookup_values = d_p_lookup.get_storage().values;
+    for(unsigned int i=0; i<d_vocab_size; ++i){
+        std::vector<float> embed = dynet::as_vector(lookup_values[i]);
+        lookup.insert(lookup.end(), embed.begin(), embed.end());
+    }
+    write_frozen_tensor(&ofs, &header, FrozenLmFormat::LOOKUP, lookup);
+
+    // rnn params: {x2z, h2z, bz, x2r, h2r, br, x2h, h2h, bh} for a single layer
+    dynet::GRUBuilder* rnns[2] = {&d_source_rnn, &d_target_rnn};
+    unsigned int rnn_tensor_ids[2] = {FrozenLmFormat::SOURCE_RNN, FrozenLmFormat::TARGET_RNN};
+    for(unsigned int k=0; k<2; ++k){
+        const std::vector<std::shared_ptr<dynet::ParameterStorage> >& rnn_params =
+                            rnns[k]->get_parameter_collection().parameters_list();
+        if(rnn_params.size() != FrozenLmFormat::NUM_GRU_TENSORS){
+            std::cout << "unexpected number of rnn params: " << rnn_params.size() << std::endl;
+            abort();
+        }
+        for(unsigned int i=0; i<FrozenLmFormat::NUM_GRU_TENSORS; ++i){
+            std::vector<float> values = dynet::as_vector(rnn_params[i]->values);
+            unsigned int cols = (i % 3 == 0) ? d_input_dim : d_hidden_dim;
+            if(i % 3 != 2){
+                values = to_row_major(values, d_hidden_dim, cols);
+            }
+            write_frozen_tensor(&ofs, &header, rnn_tensor_ids[k] + i, values);
+        }
+    }
+
+    // remaining matrices and biases
+    struct{
+        unsigned int tensor_id;
+        dynet::Parameter* pt_param;
+        unsigned int rows;
+        unsigned int cols; // 0 for biases
+    } params[] = {
+        {FrozenLmFormat::W_HH2, &d_p_W_hh2, d_hidden2_dim, d_hidden_dim},
+        {FrozenLmFormat::B_H2,  &d_p_b_h2,  d_hidden2_dim, 0},
+        {FrozenLmFormat::W_H2M, &d_p_W_h2m, d_latent_dim,  d_hidden2_dim},
+        {FrozenLmFormat::B_M,   &d_p_b_m,   d_latent_dim,  0},
+        {FrozenLmFormat::W_H2S, &d_p_W_h2s, d_latent_dim,  d_hidden2_dim},
+        {FrozenLmFormat::B_S,   &d_p_b_s,   d_latent_dim,  0},
+        {FrozenLmFormat::W_ZH0, &d_p_W_zh0, d_hidden_dim,  d_latent_dim},
+        {FrozenLmFormat::B_H0,  &d_p_b_h0,  d_hidden_dim,  0},
+        {FrozenLmFormat::W_HV,  &d_p_W_hv,  d_vocab_size,  d_hidden_dim},
+        {FrozenLmFormat::B_V,   &d_p_b_v,   d_vocab_size,  0}
+    };
+    for(size_t i=0; i<sizeof(params)/sizeof(params[0]); ++i){
+        std::vector<float> values = dynet::as_vector(params[i].pt_param->get_storage().values);
+        if(params[i].cols != 0){
+            values = to_row_major(values, params[i].rows, params[i].cols);
+        }
+        write_frozen_tensor(&ofs, &header, params[i].tensor_id, values);
+    }
+
+    // dict
+    uint64_t offset = static_cast<uint64_t>(ofs.tellp());
+    header.dict_offset = FrozenLmFormat::align_offset(offset);
+    for(; offset<header.dict_offset; ++offset){
+        ofs.put('\0');
+    }
+    std::vector<uint64_t> word_offsets(d_vocab_size + 1, 0);
+    for(unsigned int i=0; i<d_vocab_size; ++i){
+        word_offsets[i + 1] = word_offsets[i] + dict.convert(i).size();
+    }
+    ofs.write(reinterpret_cast<const char*>(word_offsets.data()),
+              word_offsets.size() * sizeof(uint64_t));
+    for(unsigned int i=0; i<d_vocab_size; ++i){
+        const std::string& word = dict.convert(i);
+        ofs.write(word.data(), word.size());
+    }
+    header.file_size = static_cast<uint64_t>(ofs.tellp());
+
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.close();
+
+    std::cout << "Exported frozen model to " << file_path 
+              << " (" << header.file_size << " bytes)" << std::endl;
+}
+
+bool scores_match(const float& lhs, const float& rhs)
+{
+    return fabs(lhs - rhs) <= 1e-3 * (1.0 + fabs(lhs));
+}
+
+void test_frozen_export(VariationalLm* pt_model,
+                        const std::string& frozen_file,
+                        const std::vector<std::vector<int> >& data,
+                        const unsigned int& num_sents)
+{
+    /*
+    * Checks the transposed weights and the GRU kernel of FrozenLm against
+    * dynet on the same sents. Aborts if the scores differ.
+    */
+
+    FrozenLm frozenLm(frozen_file);
+    unsigned int num_tested = std::min<size_t>(num_sents, data.size());
+    bool has_scoring_error = false;
+    for(unsigned int i=0; i<num_tested; ++i){
+        float enc_error = 0.f;
+        float dec_error = pt_model->score(data[i], &enc_error);
+
+        float frozen_enc_error = 0.f;
+        float frozen_dec_error = frozenLm.score(data[i], &frozen_enc_error);
+
+        if(!scores_match(dec_error, frozen_dec_error) || !scores_match(enc_error, frozen_enc_error)){
+            has_scoring_error = true;
+            std::cout << "ERROR: frozen score does not match dynet score for sent " << i
+                      << " : frozen = " << frozen_enc_error << ", " << frozen_dec_error
+                      << " dynet = " << enc_error << ", " << dec_error
                       << std::endl;
+        }
+    }
 
-        } // batch_id
-    } // current_epoch
-} // train
+    if(has_scoring_error){
+        abort();
+    }
+
+    std::cout << "Test passed. Frozen scores match dynet scores for " << num_tested
+              << " sents" << std::endl;
+}
@@ -8,6 +8,8 @@
 #include "dynet/gru.h"
 #include "dynet/dict.h"
 
+#include <map>
+
 class VariationalLm{
 
 public:
@@ -42,6 +44,24 @@ void decode(std::shared_ptr<dynet::ComputationGraph> sp_cg,
             std::shared_ptr<dynet::Expression> sp_dec_error,
             const std::vector<int>& sents);
 
+// Minibatched encode/decode: all sents must have the same length.
+// The expressions have one batch element per sent, in the order of sents.
+void encode_batch(std::shared_ptr<dynet::ComputationGraph> sp_cg,
+                  std::shared_ptr<dynet::Expression> sp_mu,
+                  std::shared_ptr<dynet::Expression> sp_logvar,
+                  std::shared_ptr<dynet::Expression> sp_enc_error,
+                  const std::vector<const std::vector<int>*>& sents);
+
+void decode_batch(std::shared_ptr<dynet::ComputationGraph> sp_cg,
+                  std::shared_ptr<dynet::Expression> sp_z,
+                  std::shared_ptr<dynet::Expression> sp_dec_error,
+                  const std::vector<const std::vector<int>*>& sents);
+
+// Deterministic reference score in a new graph: neg log likelihood of the
+// sent decoded from z = mu. If pt_enc_error is not null, it is set to the
+// KL error of the encoder. Same as FrozenLm::score.
+float score(const std::vector<int>& sent, float* pt_enc_error=NULL);
+
 void reparameterize(std::shared_ptr<dynet::ComputationGraph> sp_cg,
                     std::shared_ptr<dynet::Expression> sp_z,
                     std::shared_ptr<dynet::Expression> sp_mu,
@@ -52,6 +72,21 @@ void train(std::vector<std::vector<int> >* pt_train_data,
            const unsigned int& max_epochs,
            const unsigned int& batch_size);
 
+// Same as above with a max batch size per sent length,
+// e.g. from MemoryCalibrator::calibrate
+void train(std::vector<std::vector<int> >* pt_train_data,
+           std::vector<std::vector<int> >* pt_valid_data,
+           const unsigned int& max_epochs,
+           const std::map<unsigned int, unsigned int>& batch_size_for_length,
+           const std::string& checkpoint_file="",
+           const dynet::Dict* pt_dict=NULL);
+
+// Writes the params and dict to a file that can be memory-mapped by FrozenLm
+void export_frozen(const std::string& file_path,
+                   const dynet::Dict& dict,
+                   const std::string& bos="<bos>",
+                   const std::string& eos="<eos>",
+                   const std::string& unk="<unk>");
 
 
 private:
@@ -91,4 +126,15 @@ dynet::LookupParameter d_p_lookup; // vocab embed
 
 };
 
+// True if two scores of the same sent agree up to the float error of
+// different summation orders
+bool scores_match(const float& lhs, const float& rhs);
+
+// Loads frozen_file with FrozenLm and aborts if its scores of the first
+// num_sents sents of data differ from the dynet encode/decode with z = mu
+void test_frozen_export(VariationalLm* pt_model,
+                        const std::string& frozen_file,
+                        const std::vector<std::vector<int> >& data,
+                        const unsigned int& num_sents);
+
 #endif